@@ -0,0 +1,32 @@
+//
+//  animation.cpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+#include "animation.hpp"
+
+// MARK: - Track
+Track::Track() {}
+
+/// @param keyframes Keyframe{frame, position, rotation}[]
+Track::Track(vector<Keyframe> keyframes) : keyframes(keyframes) {
+    stable_sort(this->keyframes.begin(), this->keyframes.end(), [](const Keyframe &a, const Keyframe &b) { return a.frame < b.frame; });
+}
+
+bool Track::empty() const {
+    return keyframes.empty();
+}
+
+Keyframe Track::operator()(int frame) const {
+    if (frame <= keyframes.front().frame) return {frame, keyframes.front().position, keyframes.front().rotation};
+    if (frame >= keyframes.back().frame) return {frame, keyframes.back().position, keyframes.back().rotation};
+    
+    auto next = upper_bound(keyframes.begin(), keyframes.end(), frame, [](int frame, const Keyframe &k) { return frame < k.frame; });
+    auto prev = next - 1;
+    
+    const float w = (float)(frame - prev->frame) / (next->frame - prev->frame);
+    return {frame, prev->position * (1 - w) + next->position * w, prev->rotation * (1 - w) + next->rotation * w};
+}
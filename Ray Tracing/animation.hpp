@@ -0,0 +1,45 @@
+//
+//  animation.hpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+struct Keyframe;
+struct Animation;
+
+class Track;
+
+#pragma once
+
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "data_types.hpp"
+
+using namespace std;
+
+struct Keyframe {
+    int frame;
+    Vector3 position, rotation;
+};
+
+struct Animation {
+    int frames = 1;
+    string output = "frame";
+};
+
+
+class Track {
+private:
+    vector<Keyframe> keyframes;
+    
+public:
+    Track();
+    explicit Track(vector<Keyframe>);
+    
+    bool empty() const;
+    Keyframe operator()(int) const;
+};
@@ -0,0 +1,28 @@
+//
+//  arena.cpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+#include "arena.hpp"
+
+// MARK: - SceneArena
+/// Destroys an object, its slot is reused by the next object of the same type
+void SceneArena::destroy(const Object *object) {
+    apply([object](auto &...pools) { (pools.destroy(object) || ...); }, objects);
+}
+
+/// Lights are always replaced all at once
+void SceneArena::releaseLights() {
+    apply([](auto &...pools) { (pools.clear(), ...); }, lights);
+}
+
+size_t SceneArena::objectMemory() const {
+    return apply([](const auto &...pools) { return (pools.memory() + ...); }, objects);
+}
+
+size_t SceneArena::lightMemory() const {
+    return apply([](const auto &...pools) { return (pools.memory() + ...); }, lights);
+}
@@ -0,0 +1,146 @@
+//
+//  arena.hpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+template<typename T> class Pool;
+class SceneArena;
+
+#pragma once
+
+#include <vector>
+#include <tuple>
+#include <new>
+#include <mutex>
+
+#include "objects.hpp"
+#include "light_sources.hpp"
+
+using namespace std;
+
+constexpr size_t cache_line = 64;
+
+// MARK: - Pool
+/// Storage for one type, objects are created in cache line aligned slots of contiguous blocks and freed slots are reused
+template<typename T>
+class Pool {
+private:
+    static constexpr size_t stride = (sizeof(T) + cache_line - 1) / cache_line * cache_line;
+    static constexpr size_t block = max<size_t>(4096 / stride, 1);
+    
+    vector<char *> blocks;
+    vector<T *> live, free;
+    
+    // Lowest addresses are handed out first, so objects created in order end up next to each other
+    void refill() {
+        free.clear();
+        for (auto it = blocks.rbegin(); it != blocks.rend(); it++) {
+            for (size_t i = block; i-- > 0;) free.push_back((T *)(*it + i * stride));
+        }
+    }
+    
+public:
+    Pool() = default;
+    Pool(const Pool &) = delete;
+    Pool &operator=(const Pool &) = delete;
+    
+    ~Pool() {
+        clear();
+        for (const auto &memory : blocks) ::operator delete(memory, align_val_t(cache_line));
+    }
+    
+    template<typename... Args>
+    T *create(Args &&...args) {
+        T *object = new (reserve()) T(forward<Args>(args)...);
+        adopt(object);
+        return object;
+    }
+    
+    /// Takes a free slot, the object is constructed in it by the caller and handed to adopt() or the slot to release()
+    T *reserve() {
+        if (free.empty()) {
+            char *memory = (char *)::operator new(stride * block, align_val_t(cache_line));
+            blocks.push_back(memory);
+            for (size_t i = block; i-- > 0;) free.push_back((T *)(memory + i * stride));
+        }
+        
+        T *slot = free.back();
+        free.pop_back();
+        return slot;
+    }
+    
+    void adopt(T *object) { live.push_back(object); }
+    void release(T *slot) { free.push_back(slot); }
+    
+    /// @return false if the object is not from this pool
+    template<typename Base>
+    bool destroy(const Base *object) {
+        auto it = find(live.begin(), live.end(), dynamic_cast<const T *>(object));
+        if (it == live.end()) return false;
+        
+        (*it)->~T();
+        free.push_back(*it);
+        live.erase(it);
+        return true;
+    }
+    
+    /// Destroys every object at once, blocks are kept for the next scene
+    void clear() {
+        for (const auto &object : live) object->~T();
+        live.clear();
+        refill();
+    }
+    
+    size_t size() const { return live.size(); }
+    size_t memory() const { return live.size() * stride; }
+};
+
+
+// MARK: - SceneArena
+/// Owns every object and light of a scene, objects can be created from several threads
+class SceneArena {
+private:
+    mutex mutex_;
+    tuple<Pool<Sphere>, Pool<Cuboid>, Pool<Plane>, Pool<Mesh>> objects;
+    tuple<Pool<PointLight>, Pool<LinearLight>, Pool<GlobalLight>, Pool<DirectionalLight>> lights;
+    
+    template<typename T>
+    Pool<T> &pool() {
+        if constexpr (is_base_of_v<Object, T>) return get<Pool<T>>(objects);
+        else return get<Pool<T>>(lights);
+    }
+    
+public:
+    /// Only taking and registering the slot is locked, constructing a mesh builds its BVH and runs in parallel with other workers
+    template<typename T, typename... Args>
+    T *create(Args &&...args) {
+        Pool<T> &pool = this->pool<T>();
+        T *slot;
+        {
+            lock_guard<mutex> lock(mutex_);
+            slot = pool.reserve();
+        }
+        
+        T *object;
+        try {
+            object = new (slot) T(forward<Args>(args)...);
+        } catch(...) {
+            lock_guard<mutex> lock(mutex_);
+            pool.release(slot);
+            throw;
+        }
+        
+        lock_guard<mutex> lock(mutex_);
+        pool.adopt(object);
+        return object;
+    }
+    
+    void destroy(const Object *);
+    void releaseLights();
+    
+    size_t objectMemory() const;
+    size_t lightMemory() const;
+};
@@ -0,0 +1,479 @@
+//
+//  bvh.cpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+#include "bvh.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+#ifndef __EMSCRIPTEN__
+#include <thread>
+#endif
+
+// MARK: - Box
+const Box Box::Empty = {{INFINITY, INFINITY, INFINITY}, {-INFINITY, -INFINITY, -INFINITY}};
+
+void Box::extend(const Box &box) {
+    min = {std::min(min.x, box.min.x), std::min(min.y, box.min.y), std::min(min.z, box.min.z)};
+    max = {std::max(max.x, box.max.x), std::max(max.y, box.max.y), std::max(max.z, box.max.z)};
+}
+
+void Box::extend(Vector3 point) {
+    extend({point, point});
+}
+
+Vector3 Box::center() const {
+    return {(min.x + max.x) / 2, (min.y + max.y) / 2, (min.z + max.z) / 2};
+}
+
+float Box::area() const {
+    if (min.x > max.x) return 0;
+    const float x = max.x - min.x, y = max.y - min.y, z = max.z - min.z;
+    return 2 * (x * y + y * z + z * x);
+}
+
+
+// MARK: - BVHBuilder
+/// Builds the nodes top down, large ranges are binned by several threads and large subtrees are built on their own thread
+class BVHBuilder {
+private:
+    static const int bins = 16, max_leaf = 8, max_depth = 60;
+    static const int parallel_binning = 1 << 15, parallel_subtree = 1 << 12;
+    
+    BVH &bvh;
+    const vector<Box> &boxes;
+    vector<Vector3> centers;
+    vector<unsigned> codes;
+    atomic<int> used;
+    static atomic<int> busy; // Extra threads running for all builders in the process, meshes are built concurrently while loading
+    
+    struct Bin {
+        Box bounds = Box::Empty;
+        int count = 0;
+    };
+    
+    /// Runs body over chunks of the range, on idle threads if the range is large enough
+    void parallel(int begin, int end, int threshold, const function<void(int, int, int)> &body, int &chunks);
+    int claim(int);
+    int allocate();
+    void leaf(int, int, int);
+    void split(int, int, int, int, int);
+    
+    void sah(int, int, int, int);
+    void morton(int, int, int, int);
+    
+public:
+    BVHBuilder(BVH &, const vector<Box> &);
+    void build(short);
+};
+
+atomic<int> BVHBuilder::busy(0);
+
+BVHBuilder::BVHBuilder(BVH &bvh, const vector<Box> &boxes) : bvh(bvh), boxes(boxes), used(0) {
+    centers.resize(boxes.size());
+    for (int i = 0; i < boxes.size(); i++) centers[i] = boxes[i].center();
+}
+
+void BVHBuilder::parallel(int begin, int end, int threshold, const function<void(int, int, int)> &body, int &chunks) {
+    chunks = 1;
+#ifndef __EMSCRIPTEN__
+    if (end - begin >= threshold) {
+        const int extra = claim((end - begin) / (threshold / 2) - 1);
+        if (extra > 0) {
+            chunks = extra + 1;
+            const int size = (end - begin + chunks - 1) / chunks;
+            vector<thread> threads;
+            for (int c = 1; c < chunks; c++) threads.push_back(thread(body, begin + c * size, min(begin + (c + 1) * size, end), c));
+            body(begin, min(begin + size, end), 0);
+            for (auto &it : threads) it.join();
+            
+            busy -= extra;
+            return;
+        }
+    }
+#endif
+    body(begin, end, 0);
+}
+
+/// Takes up to wanted threads from the budget shared by every builder, only ever out of a positive count so all builds together stay within rendering_threads
+int BVHBuilder::claim(int wanted) {
+    const int budget = max((int)settings.rendering_threads, 1) - 1;
+    int running = busy.load(), taken;
+    do {
+        taken = min(budget - running, wanted);
+        if (taken <= 0) return 0;
+    } while (!busy.compare_exchange_weak(running, running + taken));
+    return taken;
+}
+
+int BVHBuilder::allocate() {
+    return used.fetch_add(2);
+}
+
+void BVHBuilder::leaf(int node, int begin, int end) {
+    auto &target = bvh.nodes[node];
+    target.bounds = Box::Empty;
+    for (int i = begin; i < end; i++) target.bounds.extend(boxes[bvh.indices[i]]);
+    target.offset = begin;
+    target.count = end - begin;
+}
+
+/// Makes an inner node from two ranges, the left one is built on another thread when large enough
+void BVHBuilder::split(int node, int begin, int middle, int end, int depth) {
+    const int left = allocate();
+    bvh.nodes[node].offset = left;
+    bvh.nodes[node].count = 0;
+    
+    const auto recurse = [this](int child, int begin, int end, int depth) {
+        if (codes.empty()) sah(child, begin, end, depth);
+        else morton(child, begin, end, depth);
+    };
+    
+#ifndef __EMSCRIPTEN__
+    const bool large = middle - begin >= parallel_subtree && end - middle >= parallel_subtree;
+    if (large && claim(1) > 0) {
+        thread worker(recurse, left, begin, middle, depth + 1);
+        recurse(left + 1, middle, end, depth + 1);
+        worker.join();
+        busy--;
+    } else {
+        recurse(left, begin, middle, depth + 1);
+        recurse(left + 1, middle, end, depth + 1);
+    }
+#else
+    recurse(left, begin, middle, depth + 1);
+    recurse(left + 1, middle, end, depth + 1);
+#endif
+    
+    auto &target = bvh.nodes[node];
+    target.bounds = bvh.nodes[left].bounds;
+    target.bounds.extend(bvh.nodes[left + 1].bounds);
+}
+
+// MARK: Binned SAH
+/// Splits at the bin boundary with the lowest surface area heuristic cost, considering all three axes
+void BVHBuilder::sah(int node, int begin, int end, int depth) {
+    const int count = end - begin;
+    if (count <= 1 || depth >= max_depth) return leaf(node, begin, end);
+    
+    // Bounds of the centers decide the bins
+    int chunks;
+    const int most = count >= parallel_binning ? max((int)settings.rendering_threads, 1) : 1;
+    vector<pair<Box, Box>> partial(most, {Box::Empty, Box::Empty});
+    parallel(begin, end, parallel_binning, [&](int from, int to, int chunk) {
+        for (int i = from; i < to; i++) {
+            partial[chunk].first.extend(boxes[bvh.indices[i]]);
+            partial[chunk].second.extend(centers[bvh.indices[i]]);
+        }
+    }, chunks);
+    Box bounds = Box::Empty, centroids = Box::Empty;
+    for (int c = 0; c < chunks; c++) {
+        bounds.extend(partial[c].first);
+        centroids.extend(partial[c].second);
+    }
+    
+    const float extent[3] = {centroids.max.x - centroids.min.x, centroids.max.y - centroids.min.y, centroids.max.z - centroids.min.z};
+    const float minimum[3] = {centroids.min.x, centroids.min.y, centroids.min.z};
+    const auto coordinate = [this](int index, int axis) { const Vector3 &c = centers[index]; return axis == 0 ? c.x : axis == 1 ? c.y : c.z; };
+    const auto binOf = [&](int index, int axis) { return min(bins - 1, (int)((coordinate(index, axis) - minimum[axis]) * bins / extent[axis])); };
+    
+    if (extent[0] <= 0 && extent[1] <= 0 && extent[2] <= 0) {
+        // Identical centers can't be told apart
+        if (count <= max_leaf) return leaf(node, begin, end);
+        return split(node, begin, begin + count / 2, end, depth);
+    }
+    
+    // Fill the bins of every axis
+    vector<array<array<Bin, bins>, 3>> binned(most);
+    parallel(begin, end, parallel_binning, [&](int from, int to, int chunk) {
+        for (int i = from; i < to; i++) {
+            const int index = bvh.indices[i];
+            for (int axis = 0; axis < 3; axis++) {
+                if (extent[axis] <= 0) continue;
+                auto &bin = binned[chunk][axis][binOf(index, axis)];
+                bin.bounds.extend(boxes[index]);
+                bin.count++;
+            }
+        }
+    }, chunks);
+    
+    int best_axis = -1, best_split = 0;
+    float best_cost = INFINITY;
+    for (int axis = 0; axis < 3; axis++) {
+        if (extent[axis] <= 0) continue;
+        
+        array<Bin, bins> merged;
+        for (int c = 0; c < chunks; c++) {
+            for (int b = 0; b < bins; b++) {
+                merged[b].bounds.extend(binned[c][axis][b].bounds);
+                merged[b].count += binned[c][axis][b].count;
+            }
+        }
+        
+        // Sweep from the right for the areas right of each split, then from the left
+        array<float, bins> right_cost;
+        Box right = Box::Empty;
+        int right_count = 0;
+        for (int b = bins - 1; b > 0; b--) {
+            right.extend(merged[b].bounds);
+            right_count += merged[b].count;
+            right_cost[b] = right.area() * right_count;
+        }
+        
+        Box left = Box::Empty;
+        int left_count = 0;
+        for (int b = 0; b < bins - 1; b++) {
+            left.extend(merged[b].bounds);
+            left_count += merged[b].count;
+            const float cost = left.area() * left_count + right_cost[b + 1];
+            if (left_count > 0 && left_count < count && cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = b + 1;
+            }
+        }
+    }
+    
+    // Traversing a node costs as much as testing one primitive
+    const float leaf_cost = count, split_cost = 1 + best_cost / bounds.area();
+    if (best_axis < 0 || (count <= max_leaf && leaf_cost <= split_cost)) {
+        if (count <= max_leaf) return leaf(node, begin, end);
+        return split(node, begin, begin + count / 2, end, depth);
+    }
+    
+    const auto middle = partition(bvh.indices.begin() + begin, bvh.indices.begin() + end, [&](int index) { return binOf(index, best_axis) < best_split; });
+    split(node, begin, (int)(middle - bvh.indices.begin()), end, depth);
+}
+
+// MARK: Morton codes
+inline unsigned spread(unsigned v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/// Indices are sorted by the Morton code of their center, ranges are split where the highest differing bit changes
+void BVHBuilder::morton(int node, int begin, int end, int depth) {
+    const int count = end - begin;
+    if (count <= 4 || depth >= max_depth) return leaf(node, begin, end);
+    
+    const unsigned first = codes[bvh.indices[begin]], last = codes[bvh.indices[end - 1]];
+    if (first == last) return split(node, begin, begin + count / 2, end, depth);
+    
+    const unsigned bit = 1u << (31 - __builtin_clz(first ^ last));
+    const auto middle = partition_point(bvh.indices.begin() + begin, bvh.indices.begin() + end, [&](int index) { return !(codes[index] & bit); });
+    split(node, begin, (int)(middle - bvh.indices.begin()), end, depth);
+}
+
+void BVHBuilder::build(short type) {
+    const int count = (int)boxes.size();
+    bvh.nodes.assign(max(2 * count - 1, 1), {Box::Empty, 0, 0});
+    bvh.indices.resize(count);
+    for (int i = 0; i < count; i++) bvh.indices[i] = i;
+    used = 1;
+    
+    if (type == BUILD_MORTON) {
+        Box centroids = Box::Empty;
+        for (const auto &center : centers) centroids.extend(center);
+        const Vector3 extent = centroids.max - centroids.min;
+        
+        codes.resize(count);
+        int chunks;
+        parallel(0, count, parallel_binning, [&](int from, int to, int) {
+            for (int i = from; i < to; i++) {
+                const Vector3 &c = centers[i];
+                const auto quantize = [](float value, float minimum, float extent) { return extent > 0 ? (unsigned)min(1023.f, (value - minimum) / extent * 1024) : 0u; };
+                codes[i] = spread(quantize(c.x, centroids.min.x, extent.x)) << 2 | spread(quantize(c.y, centroids.min.y, extent.y)) << 1 | spread(quantize(c.z, centroids.min.z, extent.z));
+            }
+        }, chunks);
+        sort(bvh.indices.begin(), bvh.indices.end(), [this](int a, int b) { return codes[a] < codes[b] || (codes[a] == codes[b] && a < b); });
+        
+        morton(0, 0, count, 0);
+    } else sah(0, 0, count, 0);
+    
+    bvh.nodes.resize(used);
+}
+
+
+// MARK: - BVH
+/// @param boxes bounds of the primitives
+/// @param type BUILD_SAH for better trees, BUILD_MORTON for faster builds
+/// @param width children per node, 2, 4 or 8
+void BVH::build(const vector<Box> &boxes, short type, short width) {
+    const auto start = chrono::high_resolution_clock::now();
+    
+    nodes.clear();
+    nodes4.clear();
+    nodes8.clear();
+    indices.clear();
+    if (!boxes.empty()) BVHBuilder(*this, boxes).build(type);
+    refit(boxes);
+    
+    // Cost of a ray relative to testing one primitive, from the chance of it hitting each node
+    stats = Stats();
+    stats.primitives = (int)boxes.size();
+    stats.nodes = (int)nodes.size();
+    vector<int> depth(nodes.size(), 0);
+    for (int n = 0; n < nodes.size(); n++) {
+        const Node &node = nodes[n];
+        const float chance = node.bounds.area() / nodes[0].bounds.area();
+        stats.depth = max(stats.depth, depth[n]);
+        if (node.count > 0) {
+            stats.leaves++;
+            stats.sah += chance * node.count;
+        } else {
+            depth[node.offset] = depth[node.offset + 1] = depth[n] + 1;
+            stats.sah += chance;
+        }
+    }
+    
+    // The binary tree is only kept until it is collapsed
+    if (!nodes.empty() && (width == 4 || width == 8)) {
+        if (width == 4) collapse<4>();
+        else collapse<8>();
+        nodes.clear();
+        nodes.shrink_to_fit();
+        refit(boxes);
+        
+        stats.width = width;
+        stats.nodes = (int)(width == 4 ? nodes4.size() : nodes8.size());
+    }
+    
+    stats.milliseconds = chrono::duration<float, milli>(chrono::high_resolution_clock::now() - start).count();
+}
+
+BVH::Stats BVH::getStats() const {
+    return stats;
+}
+
+size_t BVH::memory() const {
+    return nodes.capacity() * sizeof(Node) + nodes4.capacity() * sizeof(WideNode<4>) + nodes8.capacity() * sizeof(WideNode<8>) + indices.capacity() * sizeof(int);
+}
+
+/// Recomputes the bounds for moved primitives, the tree is kept
+void BVH::refit(const vector<Box> &boxes) {
+    if (nodes.empty() && nodes4.empty() && nodes8.empty()) return;
+    
+    // Boxes are grown a little so rounding never lets a ray miss a box but hit a primitive inside it
+    Box all = Box::Empty;
+    for (const auto &box : boxes) all.extend(box);
+    const Vector3 size = all.max - all.min;
+    const float padding = 1e-5f * max({size.x, size.y, size.z, abs(all.min.x), abs(all.min.y), abs(all.min.z), abs(all.max.x), abs(all.max.y), abs(all.max.z)}) + 1e-6f;
+    
+    if (!nodes4.empty()) return refitWide<4>(boxes, padding);
+    if (!nodes8.empty()) return refitWide<8>(boxes, padding);
+    
+    // Children always come after their parent
+    for (int n = (int)nodes.size() - 1; n >= 0; n--) {
+        Node &node = nodes[n];
+        node.bounds = Box::Empty;
+        if (node.count > 0) {
+            for (int i = node.offset; i < node.offset + node.count; i++) node.bounds.extend(boxes[indices[i]]);
+            node.bounds.min -= {padding, padding, padding};
+            node.bounds.max += {padding, padding, padding};
+        } else {
+            node.bounds.extend(nodes[node.offset].bounds);
+            node.bounds.extend(nodes[node.offset + 1].bounds);
+        }
+    }
+}
+
+// MARK: Wide nodes
+template <> vector<BVH::WideNode<4>> &BVH::wide<4>() { return nodes4; }
+template <> vector<BVH::WideNode<8>> &BVH::wide<8>() { return nodes8; }
+
+/// Pulls up grandchildren into each node until it has W children, the largest inner child is opened first
+template <int W> void BVH::collapse() {
+    auto &target = wide<W>();
+    target.clear();
+    
+    const function<int(int)> create = [&](int n) {
+        const int index = (int)target.size();
+        target.push_back({});
+        
+        vector<int> children;
+        if (nodes[n].count > 0) children = {n};
+        else children = {nodes[n].offset, nodes[n].offset + 1};
+        while (children.size() < W) {
+            int open = -1;
+            for (int i = 0; i < children.size(); i++) {
+                if (nodes[children[i]].count == 0 && (open < 0 || nodes[children[i]].bounds.area() > nodes[children[open]].bounds.area())) open = i;
+            }
+            if (open < 0) break;
+            
+            const int child = children[open];
+            children[open] = nodes[child].offset;
+            children.push_back(nodes[child].offset + 1);
+        }
+        
+        target[index].children = children.size();
+        for (int i = 0; i < W; i++) {
+            int child = -1, count = 0;
+            if (i < children.size()) {
+                const Node &node = nodes[children[i]];
+                child = node.count > 0 ? node.offset : create(children[i]);
+                count = node.count;
+            }
+            target[index].child[i] = child;
+            target[index].count[i] = count;
+        }
+        return index;
+    };
+    
+    create(0);
+}
+
+/// Quantizes the bounds of every child to bytes, rounded outwards so they still contain it
+template <int W> void BVH::refitWide(const vector<Box> &boxes, float padding) {
+    auto &target = wide<W>();
+    vector<Box> bounds(target.size(), Box::Empty);
+    
+    // Children always come after their parent
+    for (int n = (int)target.size() - 1; n >= 0; n--) {
+        WideNode<W> &node = target[n];
+        
+        Box children[W];
+        for (int i = 0; i < node.children; i++) {
+            children[i] = Box::Empty;
+            if (node.count[i] > 0) {
+                for (int k = node.child[i]; k < node.child[i] + node.count[i]; k++) children[i].extend(boxes[indices[k]]);
+                children[i].min -= {padding, padding, padding};
+                children[i].max += {padding, padding, padding};
+            } else children[i] = bounds[node.child[i]];
+            bounds[n].extend(children[i]);
+        }
+        
+        const float minimum[3] = {bounds[n].min.x, bounds[n].min.y, bounds[n].min.z}, maximum[3] = {bounds[n].max.x, bounds[n].max.y, bounds[n].max.z};
+        for (int a = 0; a < 3; a++) {
+            node.origin[a] = minimum[a];
+            node.scale[a] = (maximum[a] - minimum[a]) / 255 * (1 + 1e-5f);
+            
+            for (int i = 0; i < W; i++) {
+                if (i >= node.children) {
+                    node.lo[a][i] = node.hi[a][i] = 0;
+                    continue;
+                }
+                
+                const float lo = a == 0 ? children[i].min.x : a == 1 ? children[i].min.y : children[i].min.z;
+                const float hi = a == 0 ? children[i].max.x : a == 1 ? children[i].max.y : children[i].max.z;
+                int qlo = node.scale[a] > 0 ? (int)floor((lo - node.origin[a]) / node.scale[a]) : 0;
+                int qhi = node.scale[a] > 0 ? (int)ceil((hi - node.origin[a]) / node.scale[a]) : 0;
+                qlo = min(max(qlo, 0), 255);
+                qhi = min(max(qhi, 0), 255);
+                while (qlo > 0 && node.origin[a] + qlo * node.scale[a] > lo) qlo--;
+                while (qhi < 255 && node.origin[a] + qhi * node.scale[a] < hi) qhi++;
+                node.lo[a][i] = qlo;
+                node.hi[a][i] = qhi;
+            }
+        }
+    }
+}
@@ -0,0 +1,241 @@
+//
+//  bvh.hpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+struct Box;
+class BVH;
+
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "settings.hpp"
+#include "data_types.hpp"
+
+using namespace std;
+
+// MARK: - Box
+struct Box {
+    Vector3 min, max;
+    
+    const static Box Empty;
+    
+    void extend(const Box &);
+    void extend(Vector3);
+    Vector3 center() const;
+    float area() const;
+    
+    /// Distance along the ray to where it enters the box, infinity on a miss
+    /// @param inverse reciprocal of the ray direction
+    inline float entry(Vector3 origin, Vector3 inverse) const {
+        const float x1 = (min.x - origin.x) * inverse.x, x2 = (max.x - origin.x) * inverse.x;
+        const float y1 = (min.y - origin.y) * inverse.y, y2 = (max.y - origin.y) * inverse.y;
+        const float z1 = (min.z - origin.z) * inverse.z, z2 = (max.z - origin.z) * inverse.z;
+        
+        const float near = std::max(std::max(std::min(x1, x2), std::min(y1, y2)), std::min(z1, z2));
+        const float far = std::min(std::min(std::max(x1, x2), std::max(y1, y2)), std::max(z1, z2));
+        
+        return far >= std::max(near, 0.f) ? near : INFINITY;
+    }
+};
+
+
+// MARK: - BVH
+/// Bounding volume hierarchy over primitives given by their boxes, nodes are stored in one array and leaves reference ranges of primitive indices
+/// Binary trees can be collapsed into 4 or 8 wide ones, their child bounds are quantized to bytes relative to the parent and tested together
+class BVH {
+private:
+    struct Node {
+        Box bounds;
+        int offset, count; // Leaf: first index and count, inner node: left child with the right one after it and 0
+    };
+    
+    template <int W> struct WideNode {
+        float origin[3], scale[3];
+        unsigned char lo[3][W], hi[3][W];
+        int child[W];             // Inner node or first index of a leaf
+        unsigned short count[W];  // Primitives of a leaf, 0 for inner nodes
+        unsigned char children;
+    };
+    
+public:
+    struct Stats {
+        int primitives = 0, nodes = 0, leaves = 0, depth = 0, width = 2;
+        float sah = 0, milliseconds = 0;
+    };
+    
+private:
+    vector<Node> nodes;
+    vector<WideNode<4>> nodes4;
+    vector<WideNode<8>> nodes8;
+    vector<int> indices;
+    Stats stats;
+    
+    template <int W> vector<WideNode<W>> &wide();
+    template <int W> void collapse();
+    template <int W> void refitWide(const vector<Box> &, float);
+    template <int W> inline static unsigned intersectWide(const WideNode<W> &, Vector3, const float *, float, float *);
+    template <int W, class F> inline int closestWide(const vector<WideNode<W>> &, Vector3, Vector3, float &, F) const;
+    
+    friend class BVHBuilder;
+    
+public:
+    void build(const vector<Box> &, short, short = 2);
+    void refit(const vector<Box> &);
+    Stats getStats() const;
+    size_t memory() const;
+    
+    /// Closest primitive in front of the ray, ties go to the lower index like in a loop over all primitives
+    /// @param distance in: far cutoff, out: distance to the primitive
+    /// @param measure distance to the primitive with the given index, negative on a miss
+    /// @return index of the primitive or -1
+    template <class F> inline int closest(Vector3 origin, Vector3 direction, float &distance, F measure) const {
+        if (!nodes4.empty()) return closestWide(nodes4, origin, direction, distance, measure);
+        if (!nodes8.empty()) return closestWide(nodes8, origin, direction, distance, measure);
+        if (nodes.empty()) return -1;
+        
+        const Vector3 inverse{1 / direction.x, 1 / direction.y, 1 / direction.z};
+        int best = -1;
+        
+        // Nodes waiting to be visited and where the ray enters them
+        int stack[64], size = 0;
+        float entries[64];
+        if ((entries[size] = nodes[0].bounds.entry(origin, inverse)) <= distance) stack[size++] = 0;
+        while (size > 0) {
+            if (entries[--size] > distance) continue;
+            const Node &node = nodes[stack[size]];
+            
+            if (node.count > 0) {
+                for (int i = node.offset; i < node.offset + node.count; i++) {
+                    const int index = indices[i];
+                    const float t = measure(index);
+                    if (t > 0 && (t < distance || (t == distance && index < best))) {
+                        distance = t;
+                        best = index;
+                    }
+                }
+                continue;
+            }
+            
+            // Nearer child goes on top of the stack, children past the closest hit so far are skipped
+            const float left = nodes[node.offset].bounds.entry(origin, inverse), right = nodes[node.offset + 1].bounds.entry(origin, inverse);
+            const bool swapped = right < left;
+            const float near = swapped ? right : left, far = swapped ? left : right;
+            if (far <= distance) {
+                entries[size] = far;
+                stack[size++] = node.offset + !swapped;
+            }
+            if (near <= distance) {
+                entries[size] = near;
+                stack[size++] = node.offset + swapped;
+            }
+        }
+        
+        return best;
+    }
+};
+
+
+// MARK: Wide traversal
+/// Tests the ray against all children of a wide node at once
+/// @param inverse reciprocal of the ray direction, finite
+/// @param entries out: where the ray enters each child that is hit
+/// @return bit mask of children hit closer than distance
+template <int W> inline unsigned BVH::intersectWide(const WideNode<W> &node, Vector3 origin, const float *inverse, float distance, float *entries) {
+    const float position[3] = {origin.x, origin.y, origin.z};
+    unsigned mask = 0;
+    
+#if defined(__SSE2__)
+    for (int g = 0; g < W; g += 4) {
+        __m128 near = _mm_setzero_ps(), far = _mm_set1_ps(distance);
+        for (int a = 0; a < 3; a++) {
+            // Child bounds are origin + byte * scale, in ray distance that is base + byte * step
+            const __m128 base = _mm_set1_ps((node.origin[a] - position[a]) * inverse[a]), step = _mm_set1_ps(node.scale[a] * inverse[a]);
+            int lo, hi;
+            memcpy(&lo, &node.lo[a][g], 4);
+            memcpy(&hi, &node.hi[a][g], 4);
+            const __m128i zero = _mm_setzero_si128();
+            const __m128 t1 = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(lo), zero), zero)), step));
+            const __m128 t2 = _mm_add_ps(base, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(hi), zero), zero)), step));
+            near = _mm_max_ps(near, _mm_min_ps(t1, t2));
+            far = _mm_min_ps(far, _mm_max_ps(t1, t2));
+        }
+        _mm_storeu_ps(entries + g, near);
+        mask |= _mm_movemask_ps(_mm_cmple_ps(near, far)) << g;
+    }
+#else
+    for (int i = 0; i < W; i++) {
+        float near = 0, far = distance;
+        for (int a = 0; a < 3; a++) {
+            const float base = (node.origin[a] - position[a]) * inverse[a], step = node.scale[a] * inverse[a];
+            const float t1 = base + node.lo[a][i] * step, t2 = base + node.hi[a][i] * step;
+            near = max(near, min(t1, t2));
+            far = min(far, max(t1, t2));
+        }
+        entries[i] = near;
+        if (near <= far) mask |= 1 << i;
+    }
+#endif
+    
+    return mask & ((1u << node.children) - 1);
+}
+
+template <int W, class F> inline int BVH::closestWide(const vector<WideNode<W>> &wide, Vector3 origin, Vector3 direction, float &distance, F measure) const {
+    // Axis parallel rays would turn empty byte offsets into 0 * infinity
+    const auto reciprocal = [](float d) { return 1 / (abs(d) < 1e-20f ? copysign(1e-20f, d) : d); };
+    const float inverse[3] = {reciprocal(direction.x), reciprocal(direction.y), reciprocal(direction.z)};
+    int best = -1;
+    
+    int stack[64 * W], size = 0;
+    float entries[64 * W];
+    entries[size] = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        if (entries[--size] > distance) continue;
+        const WideNode<W> &node = wide[stack[size]];
+        
+        float near[W];
+        unsigned mask = intersectWide(node, origin, inverse, distance, near);
+        
+        // Children that were hit, nearest first
+        int order[W], hits = 0;
+        for (; mask; mask &= mask - 1) {
+            const int i = __builtin_ctz(mask);
+            int j = hits++;
+            for (; j > 0 && near[order[j - 1]] > near[i]; j--) order[j] = order[j - 1];
+            order[j] = i;
+        }
+        
+        // Leaves are tested right away, inner nodes are pushed so the nearest is visited first
+        for (int h = 0; h < hits; h++) {
+            const int i = order[h];
+            if (node.count[i] == 0 || near[i] > distance) continue;
+            for (int k = node.child[i]; k < node.child[i] + node.count[i]; k++) {
+                const int index = indices[k];
+                const float t = measure(index);
+                if (t > 0 && (t < distance || (t == distance && index < best))) {
+                    distance = t;
+                    best = index;
+                }
+            }
+        }
+        for (int h = hits - 1; h >= 0; h--) {
+            const int i = order[h];
+            if (node.count[i] > 0 || near[i] > distance) continue;
+            entries[size] = near[i];
+            stack[size++] = node.child[i];
+        }
+    }
+    
+    return best;
+}
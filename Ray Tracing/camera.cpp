@@ -23,6 +23,11 @@ Camera::Camera(Vector3 position, Vector3 angles, float width, float height, floa
     scale = tan((fov * 0.5) / 180 * M_PI);
 }
 
+void Camera::setTransform(Vector3 position, Vector3 angles) {
+    this->position = position;
+    rotation = Matrix3x3::RotationMatrix(angles.x * (float)M_PI / 180, angles.y * (float)M_PI / 180, angles.z * (float)M_PI / 180);
+}
+
 void Camera::getDimensions(int width, int height) {
     this->width = width;
     this->height = height;
@@ -32,6 +37,11 @@ Vector3 Camera::getPosition() {
     return position;
 }
 
+/// Angle covered by a single pixel
+float Camera::getSpread() {
+    return 2 * scale / height;
+}
+
 Vector3 Camera::getRay(int x, int y) {
     float u = (2 * (x + 0.5) / width - 1) * width / height * scale;
     float v = (1 - 2 * (y + 0.5) / height) * scale;
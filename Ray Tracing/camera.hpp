@@ -13,6 +13,7 @@ class Camera;
 #include "settings.hpp"
 
 #include "data_types.hpp"
+#include "animation.hpp"
 
 class Camera {
 private:
@@ -22,9 +23,13 @@ private:
     float scale;
     
 public:
+    Track track;
+    
     Camera();
     Camera(Vector3, Vector3, float, float, float);
+    void setTransform(Vector3, Vector3);
     void getDimensions(int, int);
     Vector3 getPosition();
+    float getSpread();
     Vector3 getRay(int, int);
 };
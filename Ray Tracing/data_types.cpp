@@ -10,24 +10,12 @@
 
 
 // MARK: - Vector3
-float Vector3::length() const {
-    return sqrt(pow(x, 2) + pow(y, 2) + pow(z, 2));
-}
-
-Vector3 Vector3::normalized() const {
-    return this->operator/(length());
-}
-
 Color Vector3::asColor() const {
     const float len = length();
     return Color(x / len, y / len, z / len);
 //    return Color(x > 0 ? x / len : -x / len, y > 0 ? y / len : -y / len, z > 0 ? z / len : -z / len);
 }
 
-Vector3 Vector3::cross(const Vector3 v) const {
-    return Vector3{this->y * v.z - this->z * v.y, this->z * v.x - this->x * v.z, this->x * v.y - this->y * v.x};
-}
-
 // MARK: Defined Vectors
 const Vector3 Vector3::Zero{0, 0, 0};
 const Vector3 Vector3::One{1, 1, 1};
@@ -39,66 +27,6 @@ const Vector3 Vector3::West{0, -1, 0};
 const Vector3 Vector3::Down{0, 0, -1};
 const Vector3 Vector3::Up{0, 0, 1};
 
-Vector3 Vector3::operator+(const Vector3 v) const {
-    return Vector3{this->x + v.x, this->y + v.y, this->z + v.z};
-}
-
-Vector3 Vector3::operator-(const Vector3 v) const {
-    return Vector3{this->x - v.x, this->y - v.y, this->z - v.z};
-}
-
-Vector3 Vector3::operator-() const {
-    return Vector3{-this->x, -this->y, -this->z};
-}
-
-Vector3 Vector3::operator*(const double n) const {
-    return Vector3{this->x * (float)n, this->y * (float)n, this->z * (float)n};
-}
-
-Vector3 Vector3::operator*(const float n) const {
-    return Vector3{this->x * n, this->y * n, this->z * n};
-}
-
-Vector3 Vector3::operator*(const int n) const {
-    return Vector3{this->x * n, this->y * n, this->z * n};
-}
-
-Vector3 Vector3::operator/(const double n) const {
-    return Vector3{this->x / (float)n, this->y / (float)n, this->z / (float)n};
-}
-
-Vector3 Vector3::operator/(const float n) const {
-    return Vector3{this->x / n, this->y / n, this->z / n};
-}
-
-Vector3 Vector3::operator/(const int n) const {
-    return Vector3{this->x / n, this->y / n, this->z / n};
-}
-
-Vector3 Vector3::operator/(const Vector3 v) const {
-    return Vector3{this->x / v.x, this->y / v.y, this->z / v.z};
-}
-
-float Vector3::operator*(const Vector3 v) const {
-    return this->x * v.x + this->y * v.y + this->z * v.z;
-}
-
-void Vector3::operator+=(const Vector3 v) {
-    x = x + v.x; y = y + v.y; z = z + v.z;
-}
-
-void Vector3::operator-=(const Vector3 v) {
-    x = x - v.x; y = y - v.y; z = z - v.z;
-}
-
-bool Vector3::operator==(const Vector3 v) const {
-    return x == v.x && y == v.y && z == v.z;
-}
-
-bool Vector3::operator!=(const Vector3 v) const {
-    return x != v.x || y != v.y || z != v.z;
-}
-
 
 // MARK: - Matrix3x3
 Matrix3x3 Matrix3x3::inverse() {
@@ -140,10 +68,6 @@ Matrix3x3 Matrix3x3::RotationMatrix(float yaw, float pitch, float roll) {
     return RotationMatrixX(yaw) * RotationMatrixY(pitch) * RotationMatrixZ(roll);
 };
 
-float Matrix3x3::operator()(const int i, const int j) const {
-    return n[i][j];
-}
-
 Matrix3x3 Matrix3x3::operator+(const Matrix3x3 m) const {
     return Matrix3x3{this->n[0][0] + n[0][0], this->n[0][1] + n[0][1], this->n[0][2] + n[0][2], this->n[1][0] + n[1][0], this->n[1][1] + n[1][1], this->n[1][2] + n[1][2], this->n[2][0] + n[2][0], this->n[2][1] + n[2][1], this->n[2][2] + n[2][2]};
 }
@@ -160,28 +84,12 @@ Matrix3x3 Matrix3x3::operator*(const Matrix3x3 m) const {
     return Matrix3x3{this->n[0][0] * m(0, 0) + this->n[1][0] * m(0, 1) + this->n[2][0] * m(0, 2), this->n[0][1] * m(0, 0) + this->n[1][1] * m(0, 1) + this->n[2][1] * m(0, 2), this->n[0][2] * m(0, 0) + this->n[1][2] * m(0, 1) + this->n[2][2] * m(0, 2), this->n[0][0] * m(1, 0) + this->n[1][0] * m(1, 1) + this->n[2][0] * m(1, 2), this->n[0][1] * m(1, 0) + this->n[1][1] * m(1, 1) + this->n[2][1] * m(1, 2), this->n[0][2] * m(1, 0) + this->n[1][2] * m(1, 1) + this->n[2][2] * m(1, 2), this->n[0][0] * m(2, 0) + this->n[1][0] * m(2, 1) + this->n[2][0] * m(2, 2), this->n[0][1] * m(2, 0) + this->n[1][1] * m(2, 1) + this->n[2][1] * m(2, 2), this->n[0][2] * m(2, 0) + this->n[1][2] * m(2, 1) + this->n[2][2] * m(2, 2)};
 }
 
-Vector3 Matrix3x3::operator*(const Vector3 v) const {
-    return Vector3{this->n[0][0] * v.x + this->n[1][0] * v.y + this->n[2][0] * v.z, this->n[0][1] * v.x + this->n[1][1] * v.y + this->n[2][1] * v.z, this->n[0][2] * v.x + this->n[1][2] * v.y + this->n[2][2] * v.z};
-}
-
 
 // MARK: - Color
-Color::Color() {
-    r = g = b = 0;
-}
-
-Color::Color(float r, float g, float b) : r(r), g(g), b(b) {}
-
-Color::Color(int r, int g, int b) : r(r / 256.f), g(g / 256.f), b(b / 256.f) {}
-
 int Color::guard(float f) {
     return clamp(f * 256.f, 0.f, 255.f);
 }
 
-float Color::asValue() const {
-    return (r + g + b) / 3.f;
-}
-
 array<unsigned char, 3> Color::cimg() const {
     return std::array<unsigned char, 3>{(unsigned char)guard(r), (unsigned char)guard(g), (unsigned char)guard(b)};
 }
@@ -238,113 +146,14 @@ unsigned char Color::operator[](short i) const {
     return 0;
 }
 
-bool Color::operator==(const Color c) const {
-    return this->r == c.r && this->g == c.g && this->b == c.b;
-}
-
-Color Color::operator+(const Color c) const {
-    return Color(this->r + c.r, this->g + c.g, this->b + c.b);
-}
-
-Color Color::operator-(const Color c) const {
-    return Color(this->r - c.r, this->g - c.g, this->b - c.b);
-}
-
-Color Color::operator-() const {
-    return Color(-this->r, -this->g, -this->b);
-}
-
-Color Color::operator*(const double n) const {
-    return Color(this->r * (float)n, this->g * (float)n, this->b * (float)n);
-}
-
-Color Color::operator*(const float n) const {
-    return Color(this->r * n, this->g * n, this->b * n);
-}
-
-Color Color::operator*(const int n) const {
-    return Color(this->r * n, this->g * n, this->b * n);
-}
-
-Color Color::operator/(const double n) const {
-    return Color(this->r / (float)n, this->g / (float)n, this->b / (float)n);
-}
-
-Color Color::operator/(const float n) const {
-    return Color(this->r / n, this->g / n, this->b / n);
-}
-
-Color Color::operator/(const int n) const {
-    return Color(this->r / n, this->g / n, this->b / n);
-}
-
-Color Color::operator*(const Color c) const {
-    return Color(this->r * c.r, this->g * c.g, this->b * c.b);
-}
-
-void Color::operator+=(Color c) {
-    *this = *this + c;
-}
-
-void Color::operator-=(Color c) {
-    *this = *this - c;
-}
-
-void Color::operator*=(Color c) {
-    *this = *this * c;
-}
-
-void Color::operator/=(Color c) {
-    *this = *this / c;
-}
-
 
 // MARK: - VectorUV
-VectorUV::VectorUV() {
-    u = v = 0;
-}
-
-VectorUV::VectorUV(float u, float v) : u(u), v(v) {}
-
-VectorUV::VectorUV(int u, int v) : u(u), v(v) {}
-
 const VectorUV VectorUV::Zero{0, 0};
 
 float VectorUV::guard(float f) {
     return clamp(f, 0.f, nextafter(1.f, 0.f));
 }
 
-bool VectorUV::operator==(const VectorUV t) const {
-    return this->u == t.u && this->v == t.v;
-}
-
-bool VectorUV::operator!=(const VectorUV t) const {
-    return this->u != t.u && this->v != t.v;
-}
-
-VectorUV VectorUV::operator+(const VectorUV t) const {
-    return VectorUV{this->u + t.u, this->v + t.v};
-}
-
-VectorUV VectorUV::operator-(const VectorUV t) const {
-    return VectorUV{this->u - t.u, this->v - t.v};
-}
-
-VectorUV VectorUV::operator-() const {
-    return VectorUV{-this->u, -this->v};
-}
-
-VectorUV VectorUV::operator*(const double n) const {
-    return VectorUV{this->u * (float)n, this->v * (float)n};
-}
-
-VectorUV VectorUV::operator*(const float n) const {
-    return VectorUV{this->u * n, this->v * n};
-}
-
-VectorUV VectorUV::operator*(const int n) const {
-    return VectorUV{this->u * n, this->v * n};
-}
 float VectorUV::getU() const {
     return guard(u);
 }
@@ -353,18 +162,6 @@ float VectorUV::getV() const {
     return guard(v);
 }
 
-VectorUV VectorUV::operator/(const double n) const {
-    return VectorUV{this->u / (float)n, this->v / (float)n};
-}
-
-VectorUV VectorUV::operator/(const float n) const {
-    return VectorUV{this->u / n, this->v / n};
-}
-
-VectorUV VectorUV::operator/(const int n) const {
-    return VectorUV{this->u / n, this->v / n};
-}
-
 
 // MARK: - NeuralNetwork
 NeuralNetwork::NeuralNetwork(vector<vector<vector<float>>> &nodes) {
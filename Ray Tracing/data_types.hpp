@@ -9,6 +9,8 @@
 struct Vector3;
 struct Matrix3x3;
 struct Color;
+struct Bitmap;
+struct Random;
 struct NeuralNetwork;
 template<typename T> class ConcurrentQueue;
 
@@ -17,37 +19,71 @@ template<typename T> class ConcurrentQueue;
 #include <cmath>
 #include <vector>
 #include <array>
+#include <algorithm>
 #include <sstream>
+#include <cstdint>
+
+#if defined(VECTOR_SIMD) && defined(__SSE__)
+#include <xmmintrin.h>
+#elif defined(VECTOR_SIMD) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 using namespace std;
 
 typedef vector<vector<Color>> Buffer;
 
-struct Vector3 {
+// Built with VECTOR_SIMD, Vector3 and Color get a fourth lane and 16 byte alignment, their operators then compile to single SSE/NEON instructions
+#ifdef VECTOR_SIMD
+#define VECTOR_ALIGN alignas(16)
+#define VECTOR_LANE(expression) , expression
+#else
+#define VECTOR_ALIGN
+#define VECTOR_LANE(expression)
+#endif
+
+/// Reciprocal square root, VECTOR_SIMD uses the hardware estimate refined by one Newton-Raphson step
+inline float rsqrt(float f) {
+#if defined(VECTOR_SIMD) && defined(__SSE__)
+    const float e = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(f)));
+    return e * (1.5f - 0.5f * f * e * e);
+#elif defined(VECTOR_SIMD) && defined(__aarch64__)
+    const float e = vrsqrtes_f32(f);
+    return e * vrsqrtss_f32(f * e, e);
+#else
+    return 1 / sqrt(f);
+#endif
+}
+
+
+struct VECTOR_ALIGN Vector3 {
     float x, y, z;
+#ifdef VECTOR_SIMD
+    float w = 0;
+#endif
     
-    float length() const;
-    Vector3 normalized() const;
+    inline float length() const { return sqrt(x * x + y * y + z * z); }
+    inline Vector3 normalized() const { return *this * rsqrt(x * x + y * y + z * z); }
     Color asColor() const;
-    Vector3 cross(const Vector3) const;
+    constexpr Vector3 cross(const Vector3 v) const { return {y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x}; }
     
     const static Vector3 Zero, One, North, South, East, West, Up, Down;
     
-    Vector3 operator+(const Vector3) const;
-    Vector3 operator-(const Vector3) const;
-    Vector3 operator-() const;
-    Vector3 operator*(const double) const;
-    Vector3 operator*(const float) const;
-    Vector3 operator*(const int) const;
-    Vector3 operator/(const double) const;
-    Vector3 operator/(const float) const;
-    Vector3 operator/(const int) const;
-    Vector3 operator/(const Vector3) const;
-    float operator*(const Vector3) const;
-    void operator+=(const Vector3);
-    void operator-=(const Vector3);
-    bool operator==(const Vector3) const;
-    bool operator!=(const Vector3) const;
+    constexpr Vector3 operator+(const Vector3 v) const { return {x + v.x, y + v.y, z + v.z VECTOR_LANE(w + v.w)}; }
+    constexpr Vector3 operator-(const Vector3 v) const { return {x - v.x, y - v.y, z - v.z VECTOR_LANE(w - v.w)}; }
+    constexpr Vector3 operator-() const { return {-x, -y, -z VECTOR_LANE(-w)}; }
+    constexpr Vector3 operator*(const double n) const { return *this * (float)n; }
+    constexpr Vector3 operator*(const float n) const { return {x * n, y * n, z * n VECTOR_LANE(w * n)}; }
+    constexpr Vector3 operator*(const int n) const { return *this * (float)n; }
+    constexpr Vector3 operator/(const double n) const { return *this / (float)n; }
+    constexpr Vector3 operator/(const float n) const { return {x / n, y / n, z / n VECTOR_LANE(w / n)}; }
+    constexpr Vector3 operator/(const int n) const { return *this / (float)n; }
+    constexpr Vector3 operator/(const Vector3 v) const { return {x / v.x, y / v.y, z / v.z}; }
+    constexpr float operator*(const Vector3 v) const { return x * v.x + y * v.y + z * v.z; }
+    constexpr void operator+=(const Vector3 v) { *this = *this + v; }
+    constexpr void operator-=(const Vector3 v) { *this = *this - v; }
+    constexpr bool operator==(const Vector3 v) const { return x == v.x && y == v.y && z == v.z; }
+    constexpr bool operator!=(const Vector3 v) const { return x != v.x || y != v.y || z != v.z; }
 };
 
 
@@ -62,25 +98,28 @@ struct Matrix3x3 {
     static Matrix3x3 RotationMatrixZ(float);
     static Matrix3x3 RotationMatrix(float, float, float);
     
-    float operator()(const int, const int) const;
+    constexpr float operator()(const int i, const int j) const { return n[i][j]; }
     Matrix3x3 operator+(const Matrix3x3) const;
     Matrix3x3 operator-(const Matrix3x3) const;
     Matrix3x3 operator*(const float) const;
     Matrix3x3 operator*(const Matrix3x3) const;
-    Vector3 operator*(const Vector3) const;
+    constexpr Vector3 operator*(const Vector3 v) const { return {n[0][0] * v.x + n[1][0] * v.y + n[2][0] * v.z, n[0][1] * v.x + n[1][1] * v.y + n[2][1] * v.z, n[0][2] * v.x + n[1][2] * v.y + n[2][2] * v.z}; }
 };
 
 
-struct Color {
+struct VECTOR_ALIGN Color {
     float r, g, b;
+#ifdef VECTOR_SIMD
+    float w = 0;
+#endif
     
-    Color();
-    Color(float, float, float);
-    Color(int, int, int);
+    constexpr Color() : r(0), g(0), b(0) {}
+    constexpr Color(float r, float g, float b) : r(r), g(g), b(b) {}
+    constexpr Color(int r, int g, int b) : r(r / 256.f), g(g / 256.f), b(b / 256.f) {}
     
     inline static int guard(float f);
     
-    float asValue() const;
+    constexpr float asValue() const { return (r + g + b) / 3.f; }
     array<unsigned char, 3> cimg() const;
     string css() const;
     Color light() const;
@@ -93,52 +132,99 @@ struct Color {
     
     operator int() const;
     unsigned char operator[](short) const;
-    bool operator==(const Color) const;
-    Color operator+(const Color) const;
-    Color operator-(const Color) const;
-    Color operator-() const;
-    Color operator*(const double) const;
-    Color operator*(const float) const;
-    Color operator*(const int) const;
-    Color operator/(const double) const;
-    Color operator/(const float) const;
-    Color operator/(const int) const;
-    Color operator*(const Color) const;
-    void operator+=(const Color);
-    void operator-=(const Color);
-    void operator*=(const Color);
-    void operator/=(const Color);
+    constexpr bool operator==(const Color c) const { return r == c.r && g == c.g && b == c.b; }
+    constexpr Color operator+(const Color c) const { return lanes(r + c.r, g + c.g, b + c.b VECTOR_LANE(w + c.w)); }
+    constexpr Color operator-(const Color c) const { return lanes(r - c.r, g - c.g, b - c.b VECTOR_LANE(w - c.w)); }
+    constexpr Color operator-() const { return lanes(-r, -g, -b VECTOR_LANE(-w)); }
+    constexpr Color operator*(const double n) const { return *this * (float)n; }
+    constexpr Color operator*(const float n) const { return lanes(r * n, g * n, b * n VECTOR_LANE(w * n)); }
+    constexpr Color operator*(const int n) const { return *this * (float)n; }
+    constexpr Color operator/(const double n) const { return *this / (float)n; }
+    constexpr Color operator/(const float n) const { return lanes(r / n, g / n, b / n VECTOR_LANE(w / n)); }
+    constexpr Color operator/(const int n) const { return *this / (float)n; }
+    constexpr Color operator*(const Color c) const { return lanes(r * c.r, g * c.g, b * c.b VECTOR_LANE(w * c.w)); }
+    constexpr void operator+=(const Color c) { *this = *this + c; }
+    constexpr void operator-=(const Color c) { *this = *this - c; }
+    constexpr void operator*=(const Color c) { *this = *this * c; }
+    constexpr void operator/=(const Color c) { *this = lanes(r / c.r, g / c.g, b / c.b VECTOR_LANE(w)); }
+    
+private:
+    // All lanes of a result, so the padding lane does not break up vectorized operations
+    constexpr static Color lanes(float r, float g, float b VECTOR_LANE(float w)) {
+        Color color(r, g, b);
+#ifdef VECTOR_SIMD
+        color.w = w;
+#endif
+        return color;
+    }
+};
+
+
+// 8-bit image as loaded from disk, pixels are row-major 0xRRGGBB
+struct Bitmap {
+    int width = 0, height = 0;
+    vector<unsigned int> pixels;
 };
 
 
 struct VectorUV {
     float u, v;
     
-    VectorUV();
-    VectorUV(float, float);
-    VectorUV(int, int);
+    constexpr VectorUV() : u(0), v(0) {}
+    constexpr VectorUV(float u, float v) : u(u), v(v) {}
+    constexpr VectorUV(int u, int v) : u(u), v(v) {}
     
     inline static float guard(float f);
     
     const static VectorUV Zero;
     
-    bool operator==(const VectorUV) const;
-    bool operator!=(const VectorUV) const;
-    VectorUV operator+(const VectorUV) const;
-    VectorUV operator-(const VectorUV) const;
-    VectorUV operator-() const;
-    VectorUV operator*(const double) const;
-    VectorUV operator*(const float) const;
-    VectorUV operator*(const int) const;
-    VectorUV operator/(const double) const;
-    VectorUV operator/(const float) const;
-    VectorUV operator/(const int) const;
+    constexpr bool operator==(const VectorUV t) const { return u == t.u && v == t.v; }
+    constexpr bool operator!=(const VectorUV t) const { return u != t.u && v != t.v; }
+    constexpr VectorUV operator+(const VectorUV t) const { return {u + t.u, v + t.v}; }
+    constexpr VectorUV operator-(const VectorUV t) const { return {u - t.u, v - t.v}; }
+    constexpr VectorUV operator-() const { return {-u, -v}; }
+    constexpr VectorUV operator*(const double n) const { return *this * (float)n; }
+    constexpr VectorUV operator*(const float n) const { return {u * n, v * n}; }
+    constexpr VectorUV operator*(const int n) const { return *this * (float)n; }
+    constexpr VectorUV operator/(const double n) const { return *this / (float)n; }
+    constexpr VectorUV operator/(const float n) const { return {u / n, v / n}; }
+    constexpr VectorUV operator/(const int n) const { return *this / (float)n; }
     
     float getU() const;
     float getV() const;
 };
 
 
+// Counter-based random numbers, every value is a hash of its key and position in the sequence, so it doesn't depend on the thread or the order in which anything else is drawn
+struct Random {
+    array<uint32_t, 4> key;
+    array<uint32_t, 4> block;
+    uint32_t counter = 0;
+    
+    /// @param x, y pixel or cell
+    /// @param sample sample within the pixel, or seed
+    /// @param path ray within the sample's tree of bounces, 1 for the camera ray
+    constexpr Random(uint32_t x, uint32_t y, uint32_t sample = 0, uint32_t path = 1) : key{x | y << 16, y >> 16, sample, path << 16}, block{} {}
+    
+    /// pcg4d from Jarzynski and Olano, Hash Functions for GPU Rendering
+    constexpr static array<uint32_t, 4> hash(array<uint32_t, 4> v) {
+        for (auto &w : v) w = w * 1664525u + 1013904223u;
+        v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+        for (auto &w : v) w ^= w >> 16;
+        v[0] += v[1] * v[3]; v[1] += v[2] * v[0]; v[2] += v[0] * v[1]; v[3] += v[1] * v[2];
+        return v;
+    }
+    
+    constexpr uint32_t next() {
+        if ((counter & 3) == 0) block = hash({key[0], key[1], key[2], key[3] + (counter >> 2)});
+        return block[counter++ & 3];
+    }
+    
+    /// @return [0, 1)
+    constexpr float uniform() { return (next() >> 8) * 0x1p-24f; }
+};
+
+
 struct NeuralNetwork {
     vector<vector<vector<float>>> nodes;
     
@@ -152,6 +238,8 @@ struct NeuralNetwork {
 #include <thread>
 #include <queue>
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
 
 template<typename T>
 class ConcurrentQueue {
@@ -184,8 +272,11 @@ public:
         return true;
     }
     
+    // Set under the lock, otherwise a pop() that just found the queue empty can miss the notification and wait forever
     void stop() {
+        unique_lock<mutex> lk(mutex_);
         exit_.store(true);
+        lk.unlock();
         cond_.notify_all();
     }
 };
@@ -45,6 +45,12 @@ void Parser::parseSettings(string filename, Settings &settings) {
     bindings["max_render_distance"] = {1, &settings.max_render_distance};
     bindings["surface_bias"] = {2, &settings.surface_bias};
     bindings["max_light_bounces"] = {1, &settings.max_light_bounces};
+    bindings["wavefront"] = {0, &settings.wavefront};
+    bindings["light_threshold"] = {2, &settings.light_threshold};
+    bindings["light_samples"] = {1, &settings.light_samples};
+    bindings["bvh_build"] = {1, &settings.bvh_build};
+    bindings["bvh_width"] = {1, &settings.bvh_width};
+    bindings["watertight_triangles"] = {0, &settings.watertight_triangles};
     
     // Camera
     bindings["render_mode"] = {1, &settings.render_mode};
@@ -55,8 +61,12 @@ void Parser::parseSettings(string filename, Settings &settings) {
     bindings["resolution_decrease"] = {1, &settings.resolution_decrease};
     bindings["render_region_size"] = {1, &settings.render_region_size};
     bindings["rendering_threads"] = {1, &settings.rendering_threads};
+    bindings["cost_scheduling"] = {0, &settings.cost_scheduling};
     bindings["background_color"] = {3, &settings.background_color};
     
+    // Textures
+    bindings["texture_memory"] = {1, &settings.texture_memory};
+    
     // MARK: Parse file to structure
     stringstream buffer;
     if (interface.loadFile(filename, buffer)) {
@@ -142,132 +152,288 @@ Color Parser::parseColor(string s) {
 }
 
 Shader Parser::parseShader(json j) {
+    Shader shader;
+    
     if (!j.is_null()) {
         switch (::hash(j.value("type", "").c_str())) {
-            case "color"_h: return [color = parseColor(j.value("value", ""))](VectorUV t) { return color; };
+            case "color"_h: shader.push(parseColor(j.value("value", ""))); return shader;
             case "image"_h: {
-                Buffer buffer;
-                if (!interface.loadImage(j.value("value", "image.png"), buffer)) interface.log("Couldn't open image");
-                return [image = Image(buffer)](VectorUV t) { return image(t); };
+                const string path = j.value("value", "image.png");
+                shader.push(TextureCache::get(path, [&interface = interface, path](Bitmap &bitmap) {
+                    if (interface.loadImage(path, bitmap)) return true;
+                    interface.log("Couldn't open image " + path);
+                    return false;
+                }));
+                return shader;
             }
-            case "checkerboard"_h: return [checkerboard = Checkerboard(j.value("scale", 2), parseColor(j.value("primary", "")), parseColor(j.value("secondary", "")))](VectorUV t) { return checkerboard(t); };
-            case "bricks"_h: return [bricks = Bricks(j.value("scale", 4), j.value("ratio", 2.f), j.value("mortar", 0.1f), parseColor(j.value("primary", "")), parseColor(j.value("secondary", "")), parseColor(j.value("tertiary", "")), j.value("seed", 0))](VectorUV t) { return bricks(t); };
-            case "noise"_h: return [noise = PerlinNoise(j.value("scale", 1), j.value("seed", 0), parseColor(j.value("primary", "")))](VectorUV t) { return noise(t); };
+            case "checkerboard"_h: shader.push(Checkerboard(j.value("scale", 2), parseColor(j.value("primary", "")), parseColor(j.value("secondary", "")))); return shader;
+            case "bricks"_h: shader.push(Bricks(j.value("scale", 4), j.value("ratio", 2.f), j.value("mortar", 0.1f), parseColor(j.value("primary", "")), parseColor(j.value("secondary", "")), parseColor(j.value("tertiary", "")), j.value("seed", 0))); return shader;
+            case "noise"_h: shader.push(PerlinNoise(j.value("scale", 1), j.value("seed", 0), parseColor(j.value("primary", "")))); return shader;
                 
             case "named"_h: {
                 if (!j["value"].is_string()) break;
                 string name = j["value"];
                 if (shaders.find(name) == shaders.end()) break;
-                return shaders[name];
+                return shaders.at(name);
             }
             
             case "grayscale"_h:
                 if (!j["value"].is_object()) break;
-                return [shader = parseShader(j["value"])](VectorUV t) { return Color::White * shader(t).asValue(); };
+                shader.push(parseShader(j["value"]));
+                shader.apply(OP_GRAYSCALE);
+                return shader;
             case "negate"_h:
                 if (!j["value"].is_object()) break;
-                return [shader = parseShader(j["value"])](VectorUV t) { return -shader(t); };
-            case "add"_h: {
+                shader.push(parseShader(j["value"]));
+                shader.apply(OP_NEGATE);
+                return shader;
+            case "add"_h:
                 if (!j["values"].is_array()) break;
-                vector<Shader> operands;
-                for (auto &shader : j["values"]) operands.push_back(parseShader(shader));
-                return [=](VectorUV t) { Color result = Color::Black; for (auto &shader : operands) result += shader(t); return result; };
-            }
-            case "multiply"_h: {
+                if (j["values"].empty()) break;
+                for (int i = 0; i < j["values"].size(); i++) {
+                    shader.push(parseShader(j["values"][i]));
+                    if (i > 0) shader.apply(OP_ADD);
+                }
+                return shader;
+            case "multiply"_h:
                 if (!j["values"].is_array()) break;
-                vector<Shader> operands;
-                for (auto &shader : j["values"]) operands.push_back(parseShader(shader));
-                return [=](VectorUV t) { Color result = Color::White; for (auto &shader : operands) result *= shader(t); return result; };
-            }
-            case "mix"_h: {
+                shader.push(Color::White);
+                for (auto &operand : j["values"]) {
+                    shader.push(parseShader(operand));
+                    shader.apply(OP_MULTIPLY);
+                }
+                return shader;
+            case "mix"_h:
                 if (!j["values"].is_array() || !j["weights"].is_array() || j["values"].size() != j["weights"].size()) break;
-                vector<pair<Shader, float>> operands;
-                for (int i = 0; i < j["values"].size(); i++) operands.push_back(pair<Shader, float>(parseShader(j["values"][i]), j["weights"][i]));
-                return [=](VectorUV t) { Color result = Color::Black; for (auto &[shader, weight] : operands) result += shader(t) * weight; return result; };
-            }
+                if (j["values"].empty()) break;
+                for (int i = 0; i < j["values"].size(); i++) {
+                    shader.push(parseShader(j["values"][i]));
+                    shader.apply(OP_SCALE, j["weights"][i]);
+                    if (i > 0) shader.apply(OP_ADD);
+                }
+                return shader;
         }
     }
     
-    return [](VectorUV t) { return Color::Black; };
+    shader.push(Color::Black);
+    return shader;
 }
 
 Material Parser::parseMaterial(json j) {
-    if (!j.is_null()) return {parseShader(j["shader"]), j.value("n", 0.f), j.value("Ks", 0.f), j.value("ior", 1.f), j.value("transparent", false)};
+    if (!j.is_null()) return {parseShader(j["shader"]), j.value("n", 0.f), j.value("Ks", 0.f), j.value("ior", 1.f), j.value("transparent", false), j.value("cull_backfaces", false)};
     
-    return {parseShader(j["shader"]), 0.f, 0.f, 1.f, false};
+    return {parseShader(j["shader"]), 0.f, 0.f, 1.f, false, false};
 }
 
 Object *Parser::parseObject(json j) {
+    Object *object = nullptr;
+    
     switch (::hash(j.value("type", "").c_str())) {
-        case "sphere"_h: return new Sphere(parseVector(j["position"]), j.value("diameter", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"]));
-        case "cube"_h: return new Cuboid(parseVector(j["position"]), j.value("size", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"]));
-        case "cube-2"_h: return new Cuboid(parseVector(j["position"]), j.value("size_x", 1.f), j.value("size_y", 1.f), j.value("size_z", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"]));
-        case "cube-3"_h: return new Cuboid(parseVector(j["corner_min"]), parseVector(j["corner_max"]), parseVector(j["rotation"]), parseMaterial(j["material"]));
-        case "plane"_h: return new Plane(parseVector(j["position"]), j.value("size_x", 1.f), j.value("size_y", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"]));
+        case "sphere"_h: object = arena.create<Sphere>(parseVector(j["position"]), j.value("diameter", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"])); break;
+        case "cube"_h: object = arena.create<Cuboid>(parseVector(j["position"]), j.value("size", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"])); break;
+        case "cube-2"_h: object = arena.create<Cuboid>(parseVector(j["position"]), j.value("size_x", 1.f), j.value("size_y", 1.f), j.value("size_z", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"])); break;
+        case "cube-3"_h: object = arena.create<Cuboid>(parseVector(j["corner_min"]), parseVector(j["corner_max"]), parseVector(j["rotation"]), parseMaterial(j["material"])); break;
+        case "plane"_h: object = arena.create<Plane>(parseVector(j["position"]), j.value("size_x", 1.f), j.value("size_y", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"])); break;
         case "object"_h: {
             vector<array<Vector3, 3>> vertices;
             vector<array<VectorUV, 3>> textures;
             vector<array<Vector3, 3>> normals;
             parseGeometry_obj(j.value("name", "object.obj"), vertices, textures, normals);
-            return new Mesh({vertices, textures, normals, parseVector(j["position"]), j.value("scale", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"])});
+            object = arena.create<Mesh>(vertices, textures, normals, parseVector(j["position"]), j.value("scale", 1.f), parseVector(j["rotation"]), parseMaterial(j["material"]), j.value("bvh_width", settings.bvh_width));
+        } break;
+    }
+    
+    if (object != nullptr) object->track = parseTrack(j["keyframes"], object->getCenter(), parseVector(j["rotation"]));
+    return object;
+}
+
+/// Loads objects on rendering_threads workers, mesh geometry and image textures are decoded there instead of on first use
+/// @return objects in the same order, nullptr for invalid ones
+vector<Object *> Parser::parseObjects(const vector<json> &jobjects) {
+    vector<Object *> objects(jobjects.size(), nullptr);
+    const auto load = [&](int i) {
+        objects[i] = parseObject(jobjects[i]);
+        if (objects[i] != nullptr) objects[i]->material.texture.prefetch();
+    };
+    
+#ifndef __EMSCRIPTEN__
+    
+    ConcurrentQueue<int> task_queue, result_queue;
+    for (int i = 0; i < jobjects.size(); i++) task_queue.push(i);
+    
+    auto func = [&]() {
+        int task;
+        while (task_queue.pop(task)) {
+            load(task);
+            result_queue.push(task);
+        }
+    };
+    
+    vector<thread> threads(min((int)jobjects.size(), max((int)settings.rendering_threads, 1)));
+    for (auto &it : threads) it = thread(func);
+    
+    for (int i = 0, task; i < jobjects.size(); i++) result_queue.pop(task);
+    
+    task_queue.stop();
+    for (auto &it : threads) it.join();
+    
+#else
+    
+    for (int i = 0; i < jobjects.size(); i++) load(i);
+    
+#endif
+    
+    for (const auto &object : objects) {
+        if (const auto mesh = dynamic_cast<const Mesh *>(object)) {
+            const auto stats = mesh->getBVH().getStats();
+            interface.log("Built BVH" + to_string(stats.width) + " over " + to_string(stats.primitives) + " triangles in " + to_string(stats.milliseconds) + " ms: " + to_string(stats.nodes) + " nodes, " + to_string(stats.leaves) + " leaves, depth " + to_string(stats.depth) + ", SAH cost " + to_string(stats.sah));
         }
     }
-    return nullptr;
+    
+    return objects;
 }
 
 Light *Parser::parseLight(json j) {
     switch (::hash(j.value("type", "").c_str())) {
-        case "point"_h: return new PointLight(parseVector(j["position"]), parseColor(j["color"]), j.value("intensity", 1000));
-        case "linear"_h: return new LinearLight(parseVector(j["position"]), parseColor(j["color"]), j.value("intensity", 300));
-        case "global"_h: return new GlobalLight(parseColor(j["color"]), j.value("intensity", 0.5f));
-        case "directional"_h: return new DirectionalLight(parseVector(j["direction"]), parseColor(j["color"]), j.value("intensity", 0.5f));
+        case "point"_h: return arena.create<PointLight>(parseVector(j["position"]), parseColor(j["color"]), j.value("intensity", 1000));
+        case "linear"_h: return arena.create<LinearLight>(parseVector(j["position"]), parseColor(j["color"]), j.value("intensity", 300));
+        case "global"_h: return arena.create<GlobalLight>(parseColor(j["color"]), j.value("intensity", 0.5f));
+        case "directional"_h: return arena.create<DirectionalLight>(parseVector(j["direction"]), parseColor(j["color"]), j.value("intensity", 0.5f));
     }
     return nullptr;
 }
 
+/// Bytes held by the scene in each category
+void Parser::logMemory(const vector<Object *> &objects) {
+    size_t triangles = 0, shader_data = 0;
+    for (const auto &[_, shader] : shaders) shader_data += shader.memory();
+    for (const auto &object : objects) {
+        shader_data += object->material.texture.memory();
+        if (const auto mesh = dynamic_cast<const Mesh *>(object)) triangles += mesh->memory();
+    }
+    
+    interface.log("Scene uses " + to_string(arena.objectMemory() >> 10) + " kB for objects, " + to_string(triangles >> 10) + " kB for triangles, " + to_string(arena.lightMemory() >> 10) + " kB for lights, " + to_string(shader_data >> 10) + " kB for shaders");
+}
+
 Camera Parser::parseCamera(json j) {
-    return Camera(parseVector(j["position"]), parseVector(j["rotation"]), 0, 0, j.value("fov", 120));
+    Camera camera(parseVector(j["position"]), parseVector(j["rotation"]), 0, 0, j.value("fov", 120));
+    camera.track = parseTrack(j["keyframes"], parseVector(j["position"]), parseVector(j["rotation"]));
+    return camera;
 }
 
-void Parser::parseScene(string filename, Camera &camera, vector<Object *> &objects, vector<Light *> &lights) {
+// Values missing from a keyframe fall back to the static position and rotation
+Track Parser::parseTrack(json j, Vector3 position, Vector3 angles) {
+    vector<Keyframe> keyframes;
+    if (j.is_array()) {
+        for (auto &jkeyframe : j) keyframes.push_back({jkeyframe.value("frame", 0), jkeyframe["position"].is_object() ? parseVector(jkeyframe["position"]) : position, jkeyframe["rotation"].is_object() ? parseVector(jkeyframe["rotation"]) : angles});
+    }
+    
+    return Track(keyframes);
+}
+
+/// Reloading keeps every object whose geometry did not change, only their material is reparsed when needed
+SceneChanges Parser::parseScene(string filename, Camera &camera, vector<Object *> &objects, vector<Light *> &lights, Animation &animation) {
     interface.log("Parsing " + filename);
     
+    SceneChanges changes;
     stringstream buffer;
     if (interface.loadFile(filename, buffer)) {
         json jfile;
         
-        const string camera_key = "camera", shaders_key = "shaders", objects_key = "objects", lights_key = "lights";
+        const string camera_key = "camera", shaders_key = "shaders", objects_key = "objects", lights_key = "lights", animation_key = "animation";
         
         buffer >> jfile;
         
         // MARK: Parse camera from file
         if (jfile[camera_key].is_object()) {
-            camera = parseCamera(jfile[camera_key]);
+            if ((changes.camera = jfile[camera_key] != scene[camera_key])) camera = parseCamera(jfile[camera_key]);
         } else interface.log("Missing entry: " + camera_key);
         
         // MARK: Parse shaders from file
+        const bool shaders_changed = jfile[shaders_key] != scene[shaders_key];
         if (jfile[shaders_key].is_object()) {
-            for (const auto &[name, jshader] : jfile[shaders_key].items()) {
-                shaders[name] = parseShader(jshader);
+            if (shaders_changed) {
+                shaders.clear();
+                for (const auto &[name, jshader] : jfile[shaders_key].items()) {
+                    shaders[name] = parseShader(jshader);
+                }
             }
         } else interface.log("Missing entry: " + shaders_key);
         
         // MARK: Parse objects from file
+        const auto geometry = [](json j) { j.erase("material"); return j.dump(); };
+        multimap<string, Object *> previous;
+        for (const auto &object : objects) previous.insert({geometry(sources[object]), object});
+        
+        vector<Object *> parsed;
+        vector<json> jparsed, jpending;
         if (jfile[objects_key].is_array()) {
             for (const auto &jobject : jfile[objects_key]) {
-                auto object = parseObject(jobject);
-                if (object != nullptr) objects.push_back(object);
+                Object *object = nullptr;
+                
+                auto it = previous.find(geometry(jobject));
+                if (it != previous.end()) {
+                    object = it->second;
+                    previous.erase(it);
+                    if (shaders_changed || sources[object].value("material", json()) != jobject.value("material", json())) {
+                        const Material material = parseMaterial(jobject.value("material", json()));
+                        // Backface culling decides which triangles primary rays hit, so cached hits are dropped when it changes
+                        if (material.cull_backfaces != object->material.cull_backfaces || material.transparent != object->material.transparent) changes.objects = true;
+                        object->setMaterial(material);
+                        changes.materials = true;
+                    }
+                } else {
+                    jpending.push_back(jobject);
+                    changes.objects = true;
+                }
+                
+                // New objects are filled in once loaded
+                parsed.push_back(object);
+                jparsed.push_back(jobject);
             }
         } else interface.log("Missing entry: " + objects_key);
         
+        const auto loaded = parseObjects(jpending);
+        objects.clear();
+        for (int i = 0, l = 0; i < parsed.size(); i++) {
+            Object *object = parsed[i] != nullptr ? parsed[i] : loaded[l++];
+            if (object != nullptr) {
+                objects.push_back(object);
+                sources[object] = jparsed[i];
+            }
+        }
+        
+        for (const auto &[_, object] : previous) {
+            sources.erase(object);
+            arena.destroy(object);
+            changes.objects = true;
+        }
+        
         // MARK: Parse lights from file
         if (jfile[lights_key].is_array()) {
-            for (const auto &jlight : jfile[lights_key]) {
-                auto light = parseLight(jlight);
-                if (light != nullptr) lights.push_back(light);
+            if ((changes.lights = jfile[lights_key] != scene[lights_key])) {
+                arena.releaseLights();
+                lights.clear();
+                
+                for (const auto &jlight : jfile[lights_key]) {
+                    auto light = parseLight(jlight);
+                    if (light != nullptr) lights.push_back(light);
+                }
             }
         } else interface.log("Missing entry: " + lights_key);
+        
+        // MARK: Parse animation from file
+        animation = Animation();
+        if (jfile[animation_key].is_object()) {
+            animation.frames = max(jfile[animation_key].value("frames", 1), 1);
+            animation.output = jfile[animation_key].value("output", animation.output);
+        }
+        
+        scene = jfile;
+        logMemory(objects);
     } else interface.log("Unable to open file");
+    
+    return changes;
 }
 
 
@@ -23,23 +23,36 @@
 #include "objects.hpp"
 #include "light_sources.hpp"
 #include "camera.hpp"
+#include "animation.hpp"
+#include "arena.hpp"
 #include "interfaces.hpp"
 
 using namespace std;
 using json = nlohmann::json;
 
+struct SceneChanges {
+    bool camera = false, objects = false, materials = false, lights = false;
+};
+
 class Parser {
 private:
     NativeInterface &interface;
+    SceneArena arena;
     map<string, Shader> shaders;
     
+    json scene;
+    map<const Object *, json> sources;
+    
     Vector3 parseVector(json);
     Color parseColor(string);
     Shader parseShader(json);
     Material parseMaterial(json);
     Object *parseObject(json);
+    vector<Object *> parseObjects(const vector<json> &);
     Light *parseLight(json);
     Camera parseCamera(json);
+    Track parseTrack(json, Vector3, Vector3);
+    void logMemory(const vector<Object *> &);
     
     void parseGeometry_obj(string, vector<array<Vector3, 3>> &, vector<array<VectorUV, 3>> &, vector<array<Vector3, 3>> &);
     
@@ -47,5 +60,5 @@ public:
     explicit Parser(NativeInterface &);
     
     void parseSettings(string, Settings &);
-    void parseScene(string, Camera &, vector<Object *> &, vector<Light *> &);
+    SceneChanges parseScene(string, Camera &, vector<Object *> &, vector<Light *> &, Animation &);
 };
@@ -28,12 +28,60 @@ string formatTime(int milliseconds) {
 
 #ifndef __EMSCRIPTEN__
 
+// MARK: - Images
+/// @return false if the image couldn't be read, bitmap then holds a placeholder
+bool readImage(const string &filename, Bitmap &bitmap) {
+    CImg<unsigned char> image;
+    bool success = true;
+    
+    try {
+        image.load(filename.c_str());
+    } catch(...) {
+        image = CImg<unsigned char>(64, 64, 1, 3);
+        
+        cimg_forXYC(image, x, y, c) { image(x, y, c) = (x / 8 % 2) != (y / 8 % 2) ? Color::Black[c] : Color::Magenta[c]; }
+        image.draw_text(16, 8, "Image", Color::White.cimg().data(), 0, 1, 13);
+        image.draw_text(24, 24, "not", Color::White.cimg().data(), 0, 1, 13);
+        image.draw_text(16, 40, "found", Color::White.cimg().data(), 0, 1, 13);
+        
+        success = false;
+    }
+    
+    bitmap.width = image.width();
+    bitmap.height = image.height();
+    bitmap.pixels.resize(bitmap.width * bitmap.height);
+    cimg_forXY(image, x, y) { bitmap.pixels[y * bitmap.width + x] = image(x, y, 0) << 16 | image(x, y, 1) << 8 | image(x, y, 2); }
+    
+    return success;
+}
+
+bool writeImage(const string &filename, const Buffer &buffer) {
+    CImg<unsigned char> image((int)buffer.size(), (int)buffer[0].size(), 1, 3);
+    
+    try {
+        cimg_forXYC(image, x, y, c) { image(x, y, c) = buffer[x][y][c]; }
+        
+        image.save(filename.c_str());
+        
+        return true;
+    } catch(...) {}
+    
+    return false;
+}
+
+
+#ifndef HEADLESS
+
 // MARK: - X11Interface
 X11Interface::X11Interface(int argc, const char *argv[]) {
     path = string(argv[0]).substr(0, string(argv[0]).find_last_of('/') + 1);
     log("Path to executable: " + path);
     
     display = XOpenDisplay(nullptr);
+    if (display == nullptr) {
+        log("Unable to open display " + string(XDisplayName(nullptr)));
+        exit(1);
+    }
     scr = DefaultScreen(display);
     gc = DefaultGC(display, scr);
     screen = ScreenOfDisplay(display, scr);
@@ -53,16 +101,105 @@ X11Interface::X11Interface(int argc, const char *argv[]) {
         XNextEvent(display, &event);
         if (event.type == Expose && event.xexpose.count == 0) break;
     }
+    
+    // MARK: Image
+    Visual *visual = DefaultVisual(display, scr);
+    const int depth = DefaultDepth(display, scr);
+#ifdef XSHM
+    // Attaching fails on remote displays, the error is caught so that the image falls back to XPutImage
+    if (XShmQueryExtension(display) && (image = XShmCreateImage(display, visual, depth, ZPixmap, nullptr, &shm, width, height)) != nullptr) {
+        shm.shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+        shm.shmaddr = image->data = shm.shmid < 0 ? (char *)-1 : (char *)shmat(shm.shmid, nullptr, 0);
+        shm.readOnly = False;
+        if (shm.shmaddr != (char *)-1) {
+            static bool failed;
+            failed = false;
+            const auto handler = XSetErrorHandler([](Display *, XErrorEvent *) { failed = true; return 0; });
+            XShmAttach(display, &shm);
+            XSync(display, False);
+            XSetErrorHandler(handler);
+            
+            shared = !failed;
+            if (!shared) shmdt(shm.shmaddr);
+        }
+        // The segment is freed once both sides detach
+        if (shm.shmid >= 0) shmctl(shm.shmid, IPC_RMID, nullptr);
+        if (!shared) {
+            image->data = nullptr;
+            XDestroyImage(image);
+        }
+    }
+#endif
+    if (!shared) {
+        image = XCreateImage(display, visual, depth, ZPixmap, 0, nullptr, width, height, 32, 0);
+        image->data = (char *)calloc(image->bytes_per_line * image->height, 1);
+    }
+    const int one = 1;
+    direct = image->bits_per_pixel == 32 && image->byte_order == (*(const char *)&one ? LSBFirst : MSBFirst);
+    log(shared ? "Presenting through shared memory" : "Presenting through XPutImage");
+    
+    cells_x = (width + cell - 1) / cell;
+    cells_y = (height + cell - 1) / cell;
+    dirty.assign(cells_x * cells_y, false);
 }
 
 X11Interface::~X11Interface() {
+#ifdef XSHM
+    if (shared) {
+        XShmDetach(display, &shm);
+        XSync(display, False);
+        shmdt(shm.shmaddr);
+        image->data = nullptr;
+    }
+#endif
+    XDestroyImage(image);
     XDestroyWindow(display, window);
     XCloseDisplay(display);
 }
 
 void X11Interface::drawPixel(int x, int y, Color c) {
-    XSetForeground(display, gc, c);
-    XFillRectangle(display, window, gc, x * settings.resolution_decrease, y * settings.resolution_decrease, settings.resolution_decrease, settings.resolution_decrease);
+    const int size = settings.resolution_decrease, pixel = c;
+    const int x1 = x * size, y1 = y * size, x2 = min(x1 + size, width), y2 = min(y1 + size, height);
+    
+    for (int py = y1; py < y2; py++) {
+        if (direct) fill((uint32_t *)(image->data + py * image->bytes_per_line) + x1, (uint32_t *)(image->data + py * image->bytes_per_line) + x2, (uint32_t)pixel);
+        else for (int px = x1; px < x2; px++) XPutPixel(image, px, py, pixel);
+    }
+    
+    for (int cy = y1 / cell; cy <= (y2 - 1) / cell; cy++) {
+        for (int cx = x1 / cell; cx <= (x2 - 1) / cell; cx++) dirty[cy * cells_x + cx] = true;
+    }
+}
+
+/// Copies changed cells to the window, neighboring cells in a row go out as one request
+inline void X11Interface::present() {
+    bool any = false;
+    for (int cy = 0; cy < cells_y; cy++) {
+        for (int cx = 0; cx < cells_x;) {
+            if (!dirty[cy * cells_x + cx]) {
+                cx++;
+                continue;
+            }
+            
+            int end = cx;
+            for (; end < cells_x && dirty[cy * cells_x + end]; end++) dirty[cy * cells_x + end] = false;
+            const int x = cx * cell, y = cy * cell, w = min(end * cell, width) - x, h = min(y + cell, height) - y;
+#ifdef XSHM
+            if (shared) XShmPutImage(display, window, gc, image, x, y, x, y, w, h, False);
+            else XPutImage(display, window, gc, image, x, y, x, y, w, h);
+#else
+            XPutImage(display, window, gc, image, x, y, x, y, w, h);
+#endif
+            
+            any = true;
+            cx = end;
+        }
+    }
+    
+#ifdef XSHM
+    // The server reads the shared image while processing the requests, it has to be done before pixels change again
+    if (any && shared) XSync(display, False);
+#endif
 }
 
 void X11Interface::drawDebugBox(int x, int y, RayInput mask) {
@@ -121,8 +258,10 @@ inline void X11Interface::drawInfoString(int x, int y, stringstream &ss, Color c
 }
 
 void X11Interface::renderInfo(DebugInfo stats) {
+    present();
+    
     XSetForeground(display, gc, Color::Black);
-    XFillRectangle(display, window, gc, 2, 2, 1 + 6 * 28, 4 + 15 * 6);
+    XFillRectangle(display, window, gc, 2, 2, 1 + 6 * 28, 4 + 15 * 7);
     
     stringstream ss;
     
@@ -162,10 +301,17 @@ void X11Interface::renderInfo(DebugInfo stats) {
     ss << " (" << stats.render_mode_name << ")";
     drawInfoString(10, 6, ss, Color::Red);
     
+    ss << "Shadow cache: ";
+    drawInfoString(1, 7, ss, Color::Green);
+    if (stats.shadow_tests > 0) ss << fixed << setprecision(1) << 100.f * stats.shadow_hits / stats.shadow_tests << defaultfloat << "% hits";
+    else ss << "-";
+    drawInfoString(15, 7, ss, Color::Yellow);
+    
     refresh();
 }
 
 void X11Interface::refresh() {
+    present();
     XFlush(display);
 }
 
@@ -173,9 +319,19 @@ char X11Interface::getChar() {
     XEvent event;
     KeySym key;
     char ch;
+    refresh();
     while(true) {
         XNextEvent(display, &event);
         if (event.type == KeyPress && XLookupString(&event.xkey, &ch, 1, &key, 0) == 1) return ch;
+        
+        // Uncovered parts of the window are copied again from the image
+        if (event.type == Expose) {
+            const auto &area = event.xexpose;
+            for (int cy = area.y / cell; cy <= min(area.y + area.height - 1, height - 1) / cell; cy++) {
+                for (int cx = area.x / cell; cx <= min(area.x + area.width - 1, width - 1) / cell; cx++) dirty[cy * cells_x + cx] = true;
+            }
+            if (area.count == 0) refresh();
+        }
     }
 }
 
@@ -209,47 +365,94 @@ bool X11Interface::saveFile(string filename, const stringstream &buffer) {
     return false;
 }
 
-bool X11Interface::loadImage(string filename, Buffer &buffer) {
-    CImg<unsigned char> image;
-    bool success = true;
-    
-    try {
-        image.load(wrapFilename(filename).c_str());
-    } catch(...) {
-        image = CImg<unsigned char>(64, 64, 1, 3);
-        
-        cimg_forXYC(image, x, y, c) { image(x, y, c) = (x / 8 % 2) != (y / 8 % 2) ? Color::Black[c] : Color::Magenta[c]; }
-        image.draw_text(16, 8, "Image", Color::White.cimg().data(), 0, 1, 13);
-        image.draw_text(24, 24, "not", Color::White.cimg().data(), 0, 1, 13);
-        image.draw_text(16, 40, "found", Color::White.cimg().data(), 0, 1, 13);
-        
-        success = false;
+bool X11Interface::loadImage(string filename, Bitmap &bitmap) {
+    return readImage(wrapFilename(filename), bitmap);
+}
+
+bool X11Interface::saveImage(string filename, const Buffer &buffer) {
+    return writeImage(wrapFilename(filename), buffer);
+}
+
+void X11Interface::log(const string &message) {
+    cout << message << endl;
+}
+
+/// Contents of the window as the server shows them
+Buffer X11Interface::getFrame() {
+    XSync(display, False);
+    XImage *shot = XGetImage(display, window, 0, 0, width, height, AllPlanes, ZPixmap);
+    Buffer frame(width, vector<Color>(height));
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            const unsigned long pixel = XGetPixel(shot, x, y);
+            frame[x][y] = Color((int)(pixel >> 16 & 0xff), (int)(pixel >> 8 & 0xff), (int)(pixel & 0xff));
+        }
     }
+    XDestroyImage(shot);
     
-    buffer.resize(image.width(), vector<Color>(image.height(), Color::Black));
-    cimg_forXY(image, x, y) { buffer[x][y] = { image(x, y, 0), image(x, y, 1), image(x, y, 2) }; }
-    
-    return success;
+    return frame;
 }
 
-bool X11Interface::saveImage(string filename, const Buffer &buffer) {
-    CImg<unsigned char> image((int)buffer.size(), (int)buffer[0].size(), 1, 3);
+#else
+
+// MARK: - HeadlessInterface
+HeadlessInterface::HeadlessInterface(int, const char **, int width, int height) {
+    this->width = width;
+    this->height = height;
+    frame = Buffer(width, vector<Color>(height, Color::Black));
+}
+
+void HeadlessInterface::drawPixel(int x, int y, Color c) {
+    for (int dx = x * settings.resolution_decrease; dx < min((x + 1) * settings.resolution_decrease, width); dx++) {
+        for (int dy = y * settings.resolution_decrease; dy < min((y + 1) * settings.resolution_decrease, height); dy++) frame[dx][dy] = c;
+    }
+}
+
+void HeadlessInterface::drawDebugBox(int, int, RayInput) {}
+
+void HeadlessInterface::renderInfo(DebugInfo) {}
+
+void HeadlessInterface::refresh() {}
+
+char HeadlessInterface::getChar() {
+    return 'q';
+}
+
+bool HeadlessInterface::loadFile(string filename, stringstream &buffer) {
+    ifstream ifile(filename, ios::in);
+    buffer.str("");
     
-    try {
-        cimg_forXYC(image, x, y, c) { image(x, y, c) = buffer[x][y][c]; }
-        
-        image.save(wrapFilename(filename).c_str());
-        
-        return true;
-    } catch(...) {}
+    if (!ifile.is_open()) return false;
+    buffer << ifile.rdbuf();
+    return true;
+}
+
+bool HeadlessInterface::saveFile(string filename, const stringstream &buffer) {
+    ofstream ofile(filename, ios::out | ios::app);
     
-    return false;
+    if (!ofile.is_open()) return false;
+    ofile << buffer.rdbuf();
+    return true;
 }
 
-void X11Interface::log(const string &message) {
+bool HeadlessInterface::loadImage(string filename, Bitmap &bitmap) {
+    return readImage(filename, bitmap);
+}
+
+bool HeadlessInterface::saveImage(string filename, const Buffer &buffer) {
+    return writeImage(filename, buffer);
+}
+
+void HeadlessInterface::log(const string &message) {
     cout << message << endl;
 }
 
+const Buffer &HeadlessInterface::getFrame() const {
+    return frame;
+}
+
+#endif
+
 #else
 
 // MARK: - WASMInterface
@@ -363,7 +566,7 @@ inline void WASMInterface::drawInfoString(int x, int y, stringstream &ss, Color
 
 void WASMInterface::renderInfo(DebugInfo stats) {
     context.set("fillStyle", Color::Black.css());
-    context.call<void>("fillRect", 2, 2, 1 + 6 * 28, 4 + 15 * 6);
+    context.call<void>("fillRect", 2, 2, 1 + 6 * 28, 4 + 15 * 7);
     
     stringstream ss;
     
@@ -403,6 +606,12 @@ void WASMInterface::renderInfo(DebugInfo stats) {
     ss << " (" << stats.render_mode_name << ")";
     drawInfoString(10, 6, ss, Color::Red);
     
+    ss << "Shadow cache: ";
+    drawInfoString(1, 7, ss, Color::Green);
+    if (stats.shadow_tests > 0) ss << fixed << setprecision(1) << 100.f * stats.shadow_hits / stats.shadow_tests << defaultfloat << "% hits";
+    else ss << "-";
+    drawInfoString(15, 7, ss, Color::Yellow);
+    
     refresh();
 }
 
@@ -442,7 +651,7 @@ EMSCRIPTEN_BINDINGS(events) {
     emscripten::function("init_image", &WASMInterface::init_image);
 }
 
-bool WASMInterface::loadImage(string filename, Buffer &buffer) {
+bool WASMInterface::loadImage(string filename, Bitmap &bitmap) {
     image = val::global("Image").new_();
     image.set("src", filename);
     val::global("Promise").new_(val::module_property("init_image")).await();
@@ -459,12 +668,14 @@ bool WASMInterface::loadImage(string filename, Buffer &buffer) {
     val imageData = context.call<val>("getImageData", 0, 0, width, height);
     vector<int> arrayBuffer = vecFromJSArray<int>(imageData["data"]);
     
-    buffer.resize(width, vector<Color>(height));
+    bitmap.width = width;
+    bitmap.height = height;
+    bitmap.pixels.resize(width * height);
     
     for (int x = 0; x < width; x++) {
         for (int y = 0; y < height; y++) {
-            int i = (y * height + x) * 4;
-            buffer[x][y] = Color(arrayBuffer[i], arrayBuffer[i + 1], arrayBuffer[i + 2]);
+            int i = (y * width + x) * 4;
+            bitmap.pixels[y * width + x] = arrayBuffer[i] << 16 | arrayBuffer[i + 1] << 8 | arrayBuffer[i + 2];
         }
     }
     
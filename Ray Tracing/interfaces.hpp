@@ -10,6 +10,7 @@ struct DebugInfo;
 
 class InterfaceTemplate;
 class X11Interface;
+class HeadlessInterface;
 
 #pragma once
 
@@ -33,6 +34,7 @@ struct DebugInfo {
     int region_current, region_count, render_time, object_count;
     Timer timer;
     string render_mode_name;
+    unsigned long shadow_tests, shadow_hits;
 };
 
 
@@ -52,7 +54,7 @@ public:
     virtual bool loadFile(string, stringstream &) = 0;
     virtual bool saveFile(string, const stringstream &) = 0;
     
-    virtual bool loadImage(string, Buffer &) = 0;
+    virtual bool loadImage(string, Bitmap &) = 0;
     virtual bool saveImage(string, const Buffer &) = 0;
     
     virtual void log(const string &) = 0;
@@ -69,13 +71,22 @@ public:
 #include <CImg.h>
 #pragma clang diagnostic pop
 
+using namespace cimg_library;
+
+#ifndef HEADLESS
+
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/Xos.h>
 
-using namespace cimg_library;
+#ifdef XSHM
+#include <X11/extensions/XShm.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#endif
 
 #define X11Interface NativeInterface
+/// Pixels are drawn into an image on the client and copied to the window in batches, through shared memory when built with XSHM and the server supports it
 class X11Interface : public InterfaceTemplate {
 private:
     Display *display;
@@ -85,8 +96,19 @@ private:
     GC gc;
     string path;
     
+    XImage *image;
+#ifdef XSHM
+    XShmSegmentInfo shm;
+#endif
+    bool shared = false, direct = false; // Image in shared memory, pixels can be stored as 32 bit words without XPutPixel
+    
+    const static int cell = 32;
+    int cells_x, cells_y;
+    vector<bool> dirty; // Cells changed since they were last copied to the window
+    
     inline string wrapFilename(string);
     inline void drawInfoString(int, int, stringstream &, Color);
+    inline void present();
     
 public:
     X11Interface(int, const char **);
@@ -101,12 +123,45 @@ public:
     bool loadFile(string, stringstream &);
     bool saveFile(string, const stringstream &);
     
-    bool loadImage(string, Buffer &);
+    bool loadImage(string, Bitmap &);
+    bool saveImage(string, const Buffer &);
+    
+    void log(const string &);
+    
+    Buffer getFrame();
+};
+
+#else
+
+// MARK: - HeadlessInterface
+/// Renders into memory instead of a window, files are resolved relative to the working directory
+#define HeadlessInterface NativeInterface
+class HeadlessInterface : public InterfaceTemplate {
+private:
+    Buffer frame;
+    
+public:
+    HeadlessInterface(int, const char **, int = 160, int = 120);
+    
+    void drawPixel(int, int, Color);
+    void drawDebugBox(int, int, RayInput);
+    void renderInfo(DebugInfo);
+    void refresh();
+    char getChar();
+    
+    bool loadFile(string, stringstream &);
+    bool saveFile(string, const stringstream &);
+    
+    bool loadImage(string, Bitmap &);
     bool saveImage(string, const Buffer &);
     
     void log(const string &);
+    
+    const Buffer &getFrame() const;
 };
 
+#endif
+
 #else
 
 #include <emscripten.h>
@@ -143,7 +198,7 @@ public:
     bool loadFile(string, stringstream &);
     bool saveFile(string, const stringstream &);
     
-    bool loadImage(string, Buffer &);
+    bool loadImage(string, Bitmap &);
     bool saveImage(string, const Buffer &);
     
     void log(const string &);
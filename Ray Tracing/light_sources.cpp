@@ -8,6 +8,18 @@
 
 #include "light_sources.hpp"
 
+// MARK: - Light
+/// Sphere outside of which the diffuse value stays below threshold
+/// @param threshold smallest color channel value that matters
+/// @return false if the light reaches everywhere
+bool Light::getBounds(float, Vector3 &, float &) {
+    return false;
+}
+
+inline float peak(Color color) {
+    return max({color.r, color.g, color.b});
+}
+
 
 // MARK: - Point
 /// @param position Vector3{x, y, z}
@@ -38,6 +50,13 @@ Color PointLight::getSpecularValue(Vector3 point, Vector3 normal, Vector3 direct
     return color * pow(intensity, 0.3) * (pow(fmax(-(normal * (cosine_term * 2) - vector_to_light.normalized()) * direction, 0.f), n));
 }
 
+bool PointLight::getBounds(float threshold, Vector3 &center, float &radius) {
+    if (threshold <= 0) return false;
+    center = position;
+    radius = sqrt(peak(color) * intensity / (threshold * 4 * M_PI));
+    return true;
+}
+
 
 // MARK: - Linear
 /// @param position Vector3{x, y, z}
@@ -68,6 +87,13 @@ Color LinearLight::getSpecularValue(Vector3 point, Vector3 normal, Vector3 direc
     return color * pow(intensity, 0.4) * (pow(fmax(-(normal * (cosine_term * 2) - vector_to_light.normalized()) * direction, 0.f), n));
 }
 
+bool LinearLight::getBounds(float threshold, Vector3 &center, float &radius) {
+    if (threshold <= 0) return false;
+    center = position;
+    radius = peak(color) * intensity / (threshold * 4 * M_PI);
+    return true;
+}
+
 
 // MARK: - Global
 /// @param color Color{r, g, b} ~ (0 - 1)
@@ -110,3 +136,66 @@ Color DirectionalLight::getDiffuseValue(Vector3, Vector3) {
 Color DirectionalLight::getSpecularValue(Vector3, Vector3, Vector3, int) {
     return Color::Black;
 }
+
+
+// MARK: - Culling
+LightGrid::LightGrid() : cell(0) {}
+
+/// @param lights every light in the scene, indices are kept
+/// @param threshold diffuse value below which a light is ignored
+LightGrid::LightGrid(const vector<Light *> &lights, float threshold) : cell(0) {
+    static const int max_cells = 512;
+    
+    struct Bounds {
+        int light;
+        Vector3 center;
+        float radius;
+    };
+    vector<Bounds> bounded;
+    
+    for (int i = 0; i < lights.size(); i++) {
+        all.push_back(i);
+        
+        Bounds bounds{i};
+        if (lights[i]->getBounds(threshold, bounds.center, bounds.radius)) {
+            bounded.push_back(bounds);
+            cell += bounds.radius;
+        } else unbounded.push_back(i);
+    }
+    if (bounded.empty()) return;
+    cell = max(cell / bounded.size(), 1e-3f);
+    
+    for (const auto &bounds : bounded) {
+        const auto lower = (bounds.center - Vector3::One * bounds.radius) / cell, upper = (bounds.center + Vector3::One * bounds.radius) / cell;
+        const int x0 = floor(lower.x), y0 = floor(lower.y), z0 = floor(lower.z), x1 = floor(upper.x), y1 = floor(upper.y), z1 = floor(upper.z);
+        
+        // Lights reaching too far aren't worth bucketing
+        if ((long long)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1) > max_cells) {
+            unbounded.insert(upper_bound(unbounded.begin(), unbounded.end(), bounds.light), bounds.light);
+            continue;
+        }
+        
+        for (int x = x0; x <= x1; x++) for (int y = y0; y <= y1; y++) for (int z = z0; z <= z1; z++) cells[key(x, y, z)].push_back(bounds.light);
+    }
+    
+    // Keep lights in scene order so sums don't depend on culling
+    for (auto &[key, list] : cells) {
+        vector<int> merged;
+        merge(list.begin(), list.end(), unbounded.begin(), unbounded.end(), back_inserter(merged));
+        list = move(merged);
+    }
+}
+
+long long LightGrid::key(int x, int y, int z) const {
+    return ((long long)(x & 0x1FFFFF) << 42) | ((long long)(y & 0x1FFFFF) << 21) | (z & 0x1FFFFF);
+}
+
+/// @param point surface position
+/// @param specular whether specular highlights are needed, those don't fall off with distance
+/// @return indices of lights that may contribute, in scene order
+const vector<int> &LightGrid::query(Vector3 point, bool specular) const {
+    if (specular || cell == 0) return all;
+    
+    const auto it = cells.find(key(floor(point.x / cell), floor(point.y / cell), floor(point.z / cell)));
+    return it == cells.end() ? unbounded : it->second;
+}
@@ -11,9 +11,12 @@ struct PointLight;
 struct LinearLight;
 struct GlobalLight;
 struct DirectionalLight;
+class LightGrid;
 
 #pragma once
 
+#include <unordered_map>
+
 #include "settings.hpp"
 
 #include "data_types.hpp"
@@ -25,9 +28,11 @@ protected:
     
 public:
     bool shadow;
+    virtual ~Light() = default;
     /***/ virtual Vector3 getVector(Vector3 point) = 0;
     /***/ virtual Color getDiffuseValue(Vector3 point, Vector3 normal) = 0;
     /***/ virtual Color getSpecularValue(Vector3 point, Vector3 normal, Vector3 direction, int n) = 0;
+    /***/ virtual bool getBounds(float threshold, Vector3 &center, float &radius);
 };
 
 
@@ -41,6 +46,7 @@ public:
     Vector3 getVector(Vector3);
     Color getDiffuseValue(Vector3, Vector3);
     Color getSpecularValue(Vector3, Vector3, Vector3, int);
+    bool getBounds(float, Vector3 &, float &);
 };
 
 
@@ -54,6 +60,7 @@ public:
     Vector3 getVector(Vector3);
     Color getDiffuseValue(Vector3, Vector3);
     Color getSpecularValue(Vector3, Vector3, Vector3, int);
+    bool getBounds(float, Vector3 &, float &);
 };
 
 
@@ -80,3 +87,21 @@ public:
     Color getDiffuseValue(Vector3, Vector3);
     Color getSpecularValue(Vector3, Vector3, Vector3, int);
 };
+
+
+// MARK: - Culling
+// Lights whose diffuse contribution can reach a point, bucketed in a uniform grid sized by the average influence radius
+class LightGrid {
+private:
+    float cell;
+    vector<int> all, unbounded;
+    unordered_map<long long, vector<int>> cells;
+    
+    long long key(int, int, int) const;
+    
+public:
+    LightGrid();
+    LightGrid(const vector<Light *> &, float);
+    
+    const vector<int> &query(Vector3, bool) const;
+};
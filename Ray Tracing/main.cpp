@@ -18,6 +18,7 @@
 #include "light_sources.hpp"
 #include "ray.hpp"
 #include "camera.hpp"
+#include "animation.hpp"
 #include "renderer.hpp"
 #include "interfaces.hpp"
 
@@ -31,38 +32,74 @@ int main(int argc, const char *argv[]) {
     Camera camera;
     vector<Object *> objects;
     vector<Light *> lights;
+    Animation animation;
     
     Parser parser(interface);
     parser.parseSettings("settings.ini", settings);
-    parser.parseScene("scene.json", camera, objects, lights);
+    parser.parseScene("scene.json", camera, objects, lights, animation);
+    
+    if (argc > 1 && string(argv[1]) == "--bench") {
+        // Compare hierarchy widths on every mesh of the scene
+        for (const auto &object : objects) {
+            const auto mesh = dynamic_cast<const Mesh *>(object);
+            if (mesh == nullptr) continue;
+            
+            for (short width : {2, 4, 8}) {
+                size_t memory;
+                int hits;
+                const float rate = mesh->benchmark(width, 1 << 18, memory, hits);
+                interface.log("BVH" + to_string(width) + ": " + to_string(memory >> 10) + " kB, " + to_string((int)rate) + " rays/s, " + to_string(hits) + " hits");
+            }
+        }
+        
+        // Compare the orders regions are rendered in, every render traces the camera rays again and the fastest of 3 counts
+        // Cost scheduling is off so the pattern alone decides the order
+        static const array<string, RenderPatterns> pattern_names = {"Horizontal", "Vertical", "Spiral", "Hilbert", "Morton"};
+        Renderer renderer(interface, camera, objects, lights);
+        renderer.render();
+        settings.cost_scheduling = false;
+        for (short pattern = 0; pattern < RenderPatterns; pattern++) {
+            settings.render_pattern = pattern;
+            float best = INFINITY;
+            for (int run = 0; run < 3; run++) {
+                renderer.invalidate();
+                const auto start = chrono::high_resolution_clock::now();
+                renderer.render();
+                best = min(best, chrono::duration<float>(chrono::high_resolution_clock::now() - start).count());
+            }
+            
+            int width, height;
+            interface.getDimensions(width, height);
+            interface.log(pattern_names[pattern] + ": " + to_string((int)(best * 1000)) + " ms, " + to_string((int)(width * height / best)) + " camera rays/s");
+        }
+        return 0;
+    }
     
     Renderer renderer(interface, camera, objects, lights);
-    renderer.render();
+    if (animation.frames > 1) renderer.renderSequence(animation);
+    else renderer.render();
     
-    if (!settings.save_render) { while (interface.getChar() != 'q') continue; return 0; }
+    // Render the scene once and exit, used to train profile-guided builds
+    if (argc > 1 && string(argv[1]) == "--once") return 0;
     
-    int mode = settings.render_mode;
-    auto buffer = renderer.getResult(mode);
+    if (!settings.save_render) { while (interface.getChar() != 'q') continue; return 0; }
     
     char c = '\0';
     while ((c = interface.getChar()) != 'q') {
         if (c >= '0' && c < RenderTypes + '0') {
-            mode = c - '0';
-            buffer = renderer.getResult(mode);
-            for (int x = 0; x < buffer.size(); x++) {
-                for (int y = 0; y < buffer[x].size(); y++) {
-                    interface.drawPixel(x, y, buffer[x][y]);
-                }
-            }
-            renderer.renderInfo();
-        } else if (c == 's') interface.saveImage("output.png", buffer);
+            // Layers are shaded again from the G-buffer
+            settings.render_mode = c - '0';
+            renderer.render();
+        } else if (c == 's') interface.saveImage("output.png", renderer.getResult());
         else if (c == 'r') {
-            objects.clear();
-            lights.clear();
+            // Both settings change which surface a camera ray hits, so the G-buffer is dropped with them
+            const auto max_render_distance = settings.max_render_distance;
+            const auto watertight_triangles = settings.watertight_triangles;
             parser.parseSettings("settings.ini", settings);
-            parser.parseScene("scene.json", camera, objects, lights);
-            renderer.render();
-            buffer = renderer.getResult(mode);
+            const auto changes = parser.parseScene("scene.json", camera, objects, lights, animation);
+            if (changes.camera || changes.objects || settings.max_render_distance != max_render_distance || settings.watertight_triangles != watertight_triangles) renderer.invalidate();
+            if (animation.frames > 1) renderer.renderSequence(animation);
+            else renderer.render();
         }
     }
     
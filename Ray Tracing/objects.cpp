@@ -14,37 +14,84 @@ void ObjectInfo::operator+=(const ObjectInfo &i) {
     objects += i.objects;
 }
 
-Object::Object(Vector3 position, Vector3 angles, Material material) : center(position), material(material) {
+inline bool isIdentity(const Matrix3x3 &m) {
+    for (int i = 0; i < 3; i++) for (int j = 0; j < 3; j++) if (m(i, j) != (i == j)) return false;
+    return true;
+}
+
+Object::Object(ObjectType type, Vector3 position, Vector3 angles, Material material) : type(type), center(position), staged(false) {
     rotation = Matrix3x3::RotationMatrix(angles.x * (float)M_PI / 180, angles.y * (float)M_PI / 180, angles.z * (float)M_PI / 180);
     Irotation = rotation.inverse();
+    aligned = isIdentity(rotation);
+    setMaterial(material);
+}
+void Object::setMaterial(Material material) {
+    this->material = material;
     if (this->material.transparent) this->material.Ks = 1;
 }
+ObjectType Object::getType() const { return type; }
+bool Object::isAligned() const { return aligned; }
 Vector3 Object::getCenter() const { return center; };
 Matrix3x3 Object::getRotation() const { return rotation; }
 Matrix3x3 Object::getInverseRotation() const { return Irotation; }
 Vector3 Object::toObjectSpace(Vector3 point) const { return Irotation * (point - center); };
 Vector3 Object::toWorldSpace(Vector3 _point) const { return rotation * _point + center; };
 
+// Object space relative to the center, axis aligned objects skip the rotation
+template <bool aligned> Vector3 Object::toLocal(Vector3 point) const { return aligned ? point - center : Irotation * (point - center); }
+template <bool aligned> Vector3 Object::toGlobal(Vector3 _vector) const { return aligned ? _vector : rotation * _vector; }
+
+// Prepares the next transform without touching anything intersect() reads, so it may run while the current frame renders
+void Object::stageTransform(Vector3 position, Vector3 angles) {
+    staged_center = position;
+    staged_rotation = Matrix3x3::RotationMatrix(angles.x * (float)M_PI / 180, angles.y * (float)M_PI / 180, angles.z * (float)M_PI / 180);
+    staged_Irotation = staged_rotation.inverse();
+    staged = true;
+}
+
+void Object::commitTransform() {
+    if (!staged) return;
+    center = staged_center;
+    rotation = staged_rotation;
+    Irotation = staged_Irotation;
+    aligned = isIdentity(rotation);
+    staged = false;
+}
+
 
 // MARK: - Sphere
 /// @param position Vector3{x, y, z}
 /// @param diameter float
 /// @param angles Vector3{x, y, z}
 /// @param material Material{texture, n, Ks, ior, transparent}
-Sphere::Sphere(Vector3 position, float diameter, Vector3 angles, Material material) : Object(position, angles, material) {
+Sphere::Sphere(Vector3 position, float diameter, Vector3 angles, Material material) : Object(OBJECT_SPHERE, position, angles, material) {
     this->radius = diameter / 2.f;
-    this->radius2 = pow(radius, 2.f);
+    this->shape = {center, (float)pow(radius, 2.f)};
+}
+
+void Sphere::commitTransform() {
+    Object::commitTransform();
+    shape.center = center;
 }
 
 ObjectHit Sphere::intersect(Vector3 origin, Vector3 direction) const {
+    return aligned ? intersect<true>(origin, direction) : intersect<false>(origin, direction);
+}
+
+float Sphere::distance(Vector3 origin, Vector3 direction) const {
+    return shape.distance<true>(origin, direction);
+}
+
+// A sphere looks the same from every rotation
+template <bool aligned> float Sphere::Shape::distance(Vector3 origin, Vector3 direction) const {
     float t0, t1;
     
     Vector3 path = center - origin;
     float tca = path * direction;
-    if (tca < 0) return {-1};
+    if (tca < 0) return -1;
     
     float d2 = path * path - tca * tca;
-    if (d2 > radius2) return {-1};
+    if (d2 > radius2) return -1;
     
     float thc = sqrt(radius2 - d2);
     t0 = tca - thc;
@@ -52,31 +99,43 @@ ObjectHit Sphere::intersect(Vector3 origin, Vector3 direction) const {
     if (t0 > t1) swap(t0, t1);
     
     if (t0 < 0) {
-        if (t1 < 0) return {-1};
+        if (t1 < 0) return -1;
         t0 = t1;
     }
     
-    Vector3 point = origin + direction * t0;
-    return {t0, [=] { return getNormal(point); }, [=] { return getTexture(point); }};
+    return t0;
 }
 
+template <bool aligned> ObjectHit Sphere::intersect(Vector3 origin, Vector3 direction) const {
+    const float t = distance(origin, direction);
+    if (t < 0) return {-1};
+    
+    Vector3 point = origin + direction * t;
+    return {t, [=] { return getNormal(point); }, [=] { return getUV<aligned>(point); }, 1 / (2 * (float)M_PI * radius)};
+}
+
+// Rotating to object space and back doesn't change the direction from the center
 Vector3 Sphere::getNormal(Vector3 point) const {
-    return rotation * toObjectSpace(point).normalized();
+    return (point - center).normalized();
 }
 
-Color Sphere::getTexture(Vector3 point) const {
-    const Vector3 _point = toObjectSpace(point);
+template <bool aligned> VectorUV Sphere::getUV(Vector3 point) const {
+    const Vector3 _point = toLocal<aligned>(point);
     
     float u = asin(clamp(_point.z / radius, -1.f, 1.f)) / (2 * M_PI) + 0.25;
     float v = atan2(clamp(_point.x / radius, -1.f, 1.f), clamp(_point.y / radius, -1.f, 1.f)) / (2 * M_PI) + 0.5;
     
-    return material.texture({u, v});
+    return {u, v};
 }
 
 ObjectInfo Sphere::getInfo() const {
     return {0, 1, 1};
 }
 
+const Sphere::Shape &Sphere::getShape() const {
+    return shape;
+}
+
 
 // MARK: - Cuboid
 /// @param position Vector3{x, y, z}
@@ -91,25 +150,37 @@ Cuboid::Cuboid(Vector3 position, float size, Vector3 angles, Material material)
 /// @param size_z float
 /// @param angles Vector3{x, y, z}
 /// @param material Material{texture, n, Ks, ior, transparent}
-Cuboid::Cuboid(Vector3 position, float size_x, float size_y, float size_z, Vector3 angles, Material material) : Object(position, angles, material) {
+Cuboid::Cuboid(Vector3 position, float size_x, float size_y, float size_z, Vector3 angles, Material material) : Object(OBJECT_CUBOID, position, angles, material) {
     this->size = Vector3{size_x, size_y, size_z};
-    this->vmin = position - size / 2.f;
-    this->vmax = position + size / 2.f;
+    this->shape = {position - size / 2.f, position + size / 2.f, center, Irotation};
 }
 
 /// @param corner_min Vector3{x, y, z}
 /// @param corner_max Vector3{x, y, z}
 /// @param angles Vector3{x, y, z}
 /// @param material Material{texture, n, Ks, ior, transparent}
-Cuboid::Cuboid(Vector3 corner_min, Vector3 corner_max, Vector3 angles, Material material) : Object((corner_min + corner_max) / 2, angles, material) {
+Cuboid::Cuboid(Vector3 corner_min, Vector3 corner_max, Vector3 angles, Material material) : Object(OBJECT_CUBOID, (corner_min + corner_max) / 2, angles, material) {
     this->size = corner_max - corner_min;
-    this->vmin = corner_min;
-    this->vmax = corner_max;
+    this->shape = {corner_min, corner_max, center, Irotation};
+}
+
+void Cuboid::commitTransform() {
+    Object::commitTransform();
+    shape = {center - size / 2.f, center + size / 2.f, center, Irotation};
+}
+
+float Cuboid::distance(Vector3 origin, Vector3 direction) const {
+    return aligned ? shape.distance<true>(origin, direction) : shape.distance<false>(origin, direction);
 }
 
 ObjectHit Cuboid::intersect(Vector3 origin, Vector3 direction) const {
-    Vector3 _origin = toObjectSpace(origin) + center;
-    Vector3 _direction = Irotation * direction;
+    return aligned ? intersect<true>(origin, direction) : intersect<false>(origin, direction);
+}
+
+// Axis aligned cuboids use a plain slab test
+template <bool aligned> float Cuboid::Shape::distance(Vector3 origin, Vector3 direction) const {
+    const Vector3 _origin = aligned ? origin : Irotation * (origin - center) + center;
+    const Vector3 _direction = aligned ? direction : Irotation * direction;
     
     Vector3 tmin = (vmin - _origin) / _direction;
     Vector3 tmax = (vmax - _origin) / _direction;
@@ -118,33 +189,40 @@ ObjectHit Cuboid::intersect(Vector3 origin, Vector3 direction) const {
     if (tmin.y > tmax.y) swap(tmin.y, tmax.y);
     if (tmin.z > tmax.z) swap(tmin.z, tmax.z);
     
-    if (tmin.x > tmax.y || tmin.y > tmax.x) return {-1};
+    if (tmin.x > tmax.y || tmin.y > tmax.x) return -1;
     if (tmin.y > tmin.x) tmin.x = tmin.y;
     if (tmax.y < tmax.x) tmax.x = tmax.y;
     
-    if (tmin.x > tmax.z || tmin.z > tmax.x) return {-1};
+    if (tmin.x > tmax.z || tmin.z > tmax.x) return -1;
     if (tmin.z > tmin.x) tmin.x = tmin.z;
     if (tmax.z < tmax.x) tmax.x = tmax.z;
     
     if (tmin.x < 0) {
-        if (tmax.x < 0) return {-1};
+        if (tmax.x < 0) return -1;
         tmin.x = tmax.x;
     }
     
-    Vector3 point = origin + direction * tmin.x;
-    return {tmin.x, [=] { return getNormal(point); }, [=] { return getTexture(point); }};
+    return tmin.x;
+}
+
+template <bool aligned> ObjectHit Cuboid::intersect(Vector3 origin, Vector3 direction) const {
+    const float t = shape.distance<aligned>(origin, direction);
+    if (t < 0) return {-1};
+    
+    Vector3 point = origin + direction * t;
+    return {t, [=] { return getNormal<aligned>(point); }, [=] { return getUV<aligned>(point); }, 1 / min(size.x, min(size.y, size.z))};
 }
 
-Vector3 Cuboid::getNormal(Vector3 point) const {
-    const Vector3 _point = toObjectSpace(point);
+template <bool aligned> Vector3 Cuboid::getNormal(Vector3 point) const {
+    const Vector3 _point = toLocal<aligned>(point);
     
-    if (abs(_point.x / size.x) > abs(_point.y / size.y) && abs(_point.x / size.x) > abs(_point.z / size.z)) return rotation * Vector3{_point.x > 0 ? 1.f : -1.f, 0, 0};
-    else if (abs(_point.y / size.y) > abs(_point.z / size.z)) return rotation * Vector3{0, _point.y > 0 ? 1.f : -1.f, 0};
-    else return rotation * Vector3{0, 0, _point.z > 0 ? 1.f : -1.f};
+    if (abs(_point.x / size.x) > abs(_point.y / size.y) && abs(_point.x / size.x) > abs(_point.z / size.z)) return toGlobal<aligned>({_point.x > 0 ? 1.f : -1.f, 0, 0});
+    else if (abs(_point.y / size.y) > abs(_point.z / size.z)) return toGlobal<aligned>({0, _point.y > 0 ? 1.f : -1.f, 0});
+    else return toGlobal<aligned>({0, 0, _point.z > 0 ? 1.f : -1.f});
 }
 
-Color Cuboid::getTexture(Vector3 point) const {
-    const Vector3 _point = toObjectSpace(point);
+template <bool aligned> VectorUV Cuboid::getUV(Vector3 point) const {
+    const Vector3 _point = toLocal<aligned>(point);
     
     float u, v;
     if (abs(_point.x) > abs(_point.y) && abs(_point.x) > abs(_point.z)) {
@@ -158,13 +236,17 @@ Color Cuboid::getTexture(Vector3 point) const {
         v = _point.y / size.y + 0.5;
     }
     
-    return material.texture({u, v});
+    return {u, v};
 }
 
 ObjectInfo Cuboid::getInfo() const {
     return {8, 6, 1};
 }
 
+const Cuboid::Shape &Cuboid::getShape() const {
+    return shape;
+}
+
 
 // MARK: - Plane
 /// @param position Vector3{x, y, z}
@@ -172,76 +254,171 @@ ObjectInfo Cuboid::getInfo() const {
 /// @param size_y float
 /// @param angles Vector3{x, y, z}
 /// @param material Material{texture, n, Ks, ior, transparent}
-Plane::Plane(Vector3 position, float size_x, float size_y, Vector3 angles, Material material) : Object(position, angles, material) {
-    this->size_x = size_x;
-    this->size_y = size_y;
+Plane::Plane(Vector3 position, float size_x, float size_y, Vector3 angles, Material material) : Object(OBJECT_PLANE, position, angles, material) {
+    this->shape = {center, rotation * Vector3{0, 0, 1}, Irotation, size_x, size_y};
+}
+
+// The world space normal is precomputed, so each test needs one dot product instead of two matrix products
+void Plane::commitTransform() {
+    Object::commitTransform();
+    shape = {center, rotation * Vector3{0, 0, 1}, Irotation, shape.size_x, shape.size_y};
+}
+
+float Plane::distance(Vector3 origin, Vector3 direction) const {
+    return aligned ? shape.distance<true>(origin, direction) : shape.distance<false>(origin, direction);
 }
 
 ObjectHit Plane::intersect(Vector3 origin, Vector3 direction) const {
-    Vector3 normal = getNormal(direction);
-    float denom = normal * direction;
+    return aligned ? intersect<true>(origin, direction) : intersect<false>(origin, direction);
+}
+
+template <bool aligned> float Plane::Shape::distance(Vector3 origin, Vector3 direction) const {
+    // Facing the ray, axis aligned planes only need the z component
+    const float side = aligned ? direction.z : axis * direction;
+    const Vector3 normal = side < 0 ? (aligned ? Vector3{0, 0, 1} : axis) : (aligned ? Vector3{0, 0, -1} : -axis);
+    const float denom = -abs(side);
     
     if (denom < 0) {
-        Vector3 path = center - origin;
-        float t = path * normal / denom;
+        float t = (aligned ? (center.z - origin.z) * normal.z : (center - origin) * normal) / denom;
         
-        Vector3 _point = toObjectSpace(origin + direction * t);
-        if (abs(_point.x) > size_x / 2 || abs(_point.y) > size_y / 2) return {-1};
+        Vector3 _point = aligned ? origin + direction * t - center : Irotation * (origin + direction * t - center);
+        if (abs(_point.x) > size_x / 2 || abs(_point.y) > size_y / 2) return -1;
         
-        Vector3 point = origin + direction * t;
-        return {t, [=] { return normal; }, [=] { return getTexture(point); }};
+        return t;
     }
     
-    return {-1};
+    return -1;
+}
+
+template <bool aligned> ObjectHit Plane::intersect(Vector3 origin, Vector3 direction) const {
+    const float t = shape.distance<aligned>(origin, direction);
+    if (t < 0) return {-1};
+    
+    const Vector3 axis = shape.axis;
+    const Vector3 normal = (aligned ? direction.z : axis * direction) < 0 ? (aligned ? Vector3{0, 0, 1} : axis) : (aligned ? Vector3{0, 0, -1} : -axis);
+    Vector3 point = origin + direction * t;
+    return {t, [=] { return normal; }, [=] { return getUV<aligned>(point); }, 1 / min(shape.size_x, shape.size_y)};
 }
 
 Vector3 Plane::getNormal(Vector3 direction) const {
-    return rotation * Vector3{0, 0, (Irotation * direction).z < 0 ? 1.f : -1.f};
+    return shape.axis * direction < 0 ? shape.axis : -shape.axis;
 }
 
-Color Plane::getTexture(Vector3 point) const {
-    const Vector3 _point = toObjectSpace(point);
+template <bool aligned> VectorUV Plane::getUV(Vector3 point) const {
+    const Vector3 _point = toLocal<aligned>(point);
     
-    float u = _point.x / size_x + 0.5;
-    float v = _point.y / size_y + 0.5;
+    float u = _point.x / shape.size_x + 0.5;
+    float v = _point.y / shape.size_y + 0.5;
     
-    return material.texture({u, v});
+    return {u, v};
 }
 
 ObjectInfo Plane::getInfo() const {
     return {4, 2, 1};
 }
 
+const Plane::Shape &Plane::getShape() const {
+    return shape;
+}
+
 
 // MARK: - Triangle
 /// @param vertices Vector3{x, y, z}[3]
 /// @param textures Vector3{x, y, z}[3]
 /// @param normals Vector3{x, y, z}[3]
-/// @param material Material{texture, n, Ks, ior, transparent}
-Triangle::Triangle(array<Vector3, 3> vertices, array<VectorUV, 3> textures, array<Vector3, 3> normals, Material &material) : v0(vertices[0]), v0v1(vertices[1] - vertices[0]), v0v2(vertices[2] - vertices[0]), textures(textures), normals(normals), material(material) {
+Triangle::Triangle(array<Vector3, 3> vertices, array<VectorUV, 3> textures, array<Vector3, 3> normals) : v0(vertices[0]), v1(vertices[1]), v2(vertices[2]), textures(textures), normals(normals) {
+    const Vector3 v0v1 = v1 - v0, v0v2 = v2 - v0;
     tc = textures[0] == textures[1] && textures[0] == textures[2];
+    
+    // Texture space per world space unit, from the ratio of the triangle's areas
+    const VectorUV t1 = textures[1] - textures[0], t2 = textures[2] - textures[0];
+    const float area = v0v1.cross(v0v2).length();
+    uv_density = tc || area == 0 ? 0 : sqrt(abs(t1.u * t2.v - t1.v * t2.u) / area);
     if ((vn = (normals[0] == Vector3::Zero))) this->normals[0] = v0v1.cross(v0v2).normalized();
 }
 
-ObjectHit Triangle::intersect(Vector3 origin, Vector3 direction) const {
-    Vector3 pvec = direction.cross(v0v2);
-    float det = v0v1 * pvec;
+inline float component(Vector3 vector, int axis) {
+    return axis == 0 ? vector.x : axis == 1 ? vector.y : vector.z;
+}
 
-    if (det == 0) return {-1};
+Triangle::Ray::Ray(Vector3 origin, Vector3 direction) : origin(origin), direction(direction) {
+    const float x = abs(direction.x), y = abs(direction.y), z = abs(direction.z);
+    kz = x > y ? (x > z ? 0 : 2) : (y > z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    
+    // Swapping keeps the winding, so front faces still have positive edge functions
+    const float dz = component(direction, kz);
+    if (dz < 0) swap(kx, ky);
+    
+    sx = component(direction, kx) / dz;
+    sy = component(direction, ky) / dz;
+    sz = 1 / dz;
+}
 
-    float invDet = 1 / det;
+/// Möller-Trumbore test, or the watertight one by Woop et al. where rays through a shared edge or vertex hit at least one of its triangles
+/// @param cull skip triangles facing away from the ray, front faces wind counterclockwise
+/// @param uv out: barycentric coordinates of the hit
+/// @return distance to the triangle, -1 on a miss or behind the origin
+template <bool watertight, bool cull> float Triangle::distance(const Ray &ray, VectorUV &uv) const {
+    if (!watertight) {
+        const Vector3 v0v1 = v1 - v0, v0v2 = v2 - v0;
+        Vector3 pvec = ray.direction.cross(v0v2);
+        float det = v0v1 * pvec;
+        
+        if (cull ? det <= 0 : det == 0) return -1;
+        
+        float invDet = 1 / det;
+        
+        Vector3 tvec = ray.origin - v0;
+        float u = (tvec * pvec) * invDet;
+        if (u < 0 || u > 1) return -1;
+        
+        Vector3 qvec = tvec.cross(v0v1);
+        float v = (ray.direction * qvec) * invDet;
+        if (v < 0 || u + v > 1) return -1;
+        
+        float t = (v0v2 * qvec) * invDet;
+        uv = {u, v};
+        return t > 0 ? t : -1;
+    }
     
-    Vector3 tvec = origin - v0;
-    float u = (tvec * pvec) * invDet;
-    if (u < 0 || u > 1) return {-1};
+    // Vertices relative to the origin, sheared and projected onto the plane perpendicular to the ray
+    const Vector3 a = v0 - ray.origin, b = v1 - ray.origin, c = v2 - ray.origin;
+    const float az = component(a, ray.kz), bz = component(b, ray.kz), cz = component(c, ray.kz);
+    const float ax = component(a, ray.kx) - ray.sx * az, ay = component(a, ray.ky) - ray.sy * az;
+    const float bx = component(b, ray.kx) - ray.sx * bz, by = component(b, ray.ky) - ray.sy * bz;
+    const float cx = component(c, ray.kx) - ray.sx * cz, cy = component(c, ray.ky) - ray.sy * cz;
+    
+    // Edge functions, the ray passes through the triangle if they all have the same sign
+    float u = cx * by - cy * bx;
+    float v = ax * cy - ay * cx;
+    float w = bx * ay - by * ax;
+    
+    // On an edge the products can round either way, in double they are exact so both triangles of the edge see the same sign
+    if (u == 0 || v == 0 || w == 0) {
+        u = (float)((double)cx * by - (double)cy * bx);
+        v = (float)((double)ax * cy - (double)ay * cx);
+        w = (float)((double)bx * ay - (double)by * ax);
+    }
     
-    Vector3 qvec = tvec.cross(v0v1);
-    float v = (direction * qvec) * invDet;
-    if (v < 0 || u + v > 1) return {-1};
+    if (cull) {
+        if (u < 0 || v < 0 || w < 0) return -1;
+    } else if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return -1;
     
-    float t = (v0v2 * qvec) * invDet;
+    const float det = u + v + w;
+    if (det == 0) return -1;
     
-    return {t, [=] { return getNormal({u, v}); }, [=] { return getTexture({u, v}); }};
+    const float invDet = 1 / det;
+    const float t = (u * az + v * bz + w * cz) * ray.sz * invDet;
+    uv = {v * invDet, w * invDet};
+    return t > 0 ? t : -1;
+}
+
+/// @param t distance to the triangle
+/// @param uv barycentric coordinates of the hit
+ObjectHit Triangle::intersect(float t, VectorUV uv) const {
+    return {t, [=] { return getNormal(uv); }, [=] { return getUV(uv); }, uv_density};
 }
 
 Vector3 Triangle::getNormal(VectorUV t) const {
@@ -250,12 +427,10 @@ Vector3 Triangle::getNormal(VectorUV t) const {
     return normals[0] * (1 - t.getU() - t.getV()) + normals[1] * t.getU() + normals[2] * t.getV();
 }
 
-Color Triangle::getTexture(VectorUV t) const {
-    if (tc) return material.texture({0, 0});
+VectorUV Triangle::getUV(VectorUV t) const {
+    if (tc) return VectorUV::Zero;
     
-    VectorUV tex = textures[0] * (1 - t.getU() - t.getV()) + textures[1] * t.getU() + textures[2] * t.getV();
-    
-    return material.texture(tex);
+    return textures[0] * (1 - t.getU() - t.getV()) + textures[1] * t.getU() + textures[2] * t.getV();
 }
 
 ObjectInfo Triangle::getInfo() const {
@@ -271,14 +446,27 @@ ObjectInfo Triangle::getInfo() const {
 /// @param scale float
 /// @param angles Vector3{x, y, z}
 /// @param material Material{texture, n, Ks, ior, transparent}
-Mesh::Mesh(vector<array<Vector3, 3>> vertices, vector<array<VectorUV, 3>> textures, vector<array<Vector3, 3>> normals, Vector3 position, float scale, Vector3 angles, Material material) : Object(position, angles, material), bounds({}, {}, {}, {}) {
+/// @param width children per hierarchy node, 2, 4 or 8
+Mesh::Mesh(vector<array<Vector3, 3>> vertices, vector<array<VectorUV, 3>> textures, vector<array<Vector3, 3>> normals, Vector3 position, float scale, Vector3 angles, Material material, short width) : Object(OBJECT_MESH, position, angles, material), vertices(vertices), normals(normals), textures(textures), scale(scale), bounds({}, {}, {}, {}), staged_bounds({}, {}, {}, {}) {
+    bvh.build(build(center, rotation, triangles, bounds), settings.bvh_build, width);
+}
+
+/// @return bounds of every triangle
+vector<Box> Mesh::build(Vector3 position, Matrix3x3 rotation, vector<Triangle> &triangles, Cuboid &bounds) const {
+    triangles.clear();
+    triangles.reserve(vertices.size());
+    vector<Box> boxes;
+    boxes.reserve(vertices.size());
+    
     Vector3 vmin = Vector3::Zero;
     Vector3 vmax = Vector3::Zero;
-    if (vertices.size() > 0) vmin = vmax = toWorldSpace(vertices[0][0] * scale);
+    if (vertices.size() > 0) vmin = vmax = rotation * (vertices[0][0] * scale) + position;
     for (int i = 0; i < vertices.size(); i++) {
-        auto &triangle = vertices[i];
+        auto triangle = vertices[i];
+        Box box = Box::Empty;
         for (auto &vertex : triangle) {
-            vertex = toWorldSpace(vertex * scale);
+            vertex = rotation * (vertex * scale) + position;
+            box.extend(vertex);
             if (vertex.x < vmin.x) vmin.x = vertex.x;
             else if (vertex.x > vmax.x) vmax.x = vertex.x;
             if (vertex.y < vmin.y) vmin.y = vertex.y;
@@ -296,30 +484,204 @@ Mesh::Mesh(vector<array<Vector3, 3>> vertices, vector<array<VectorUV, 3>> textur
             for (auto &norm : normal) norm = (rotation * norm).normalized();
         }
         
-        this->triangles.push_back(Triangle(triangle, texture, normal, this->material));
+        triangles.push_back(Triangle(triangle, texture, normal));
+        boxes.push_back(box);
     }
     bounds = Cuboid(vmin, vmax, Vector3::Zero, {});
+    
+    return boxes;
 }
 
-ObjectHit Mesh::intersect(Vector3 origin, Vector3 direction) const {
-    if (bounds.intersect(origin, direction).distance < 0) return {-1};
+// Only the triangles are rebuilt (and the bounds refit), the parsed geometry is kept for every frame
+void Mesh::stageTransform(Vector3 position, Vector3 angles) {
+    Object::stageTransform(position, angles);
+    staged_bvh = bvh;
+    staged_bvh.refit(build(staged_center, staged_rotation, staged_triangles, staged_bounds));
+}
+
+void Mesh::commitTransform() {
+    if (!staged) return;
+    Object::commitTransform();
+    swap(triangles, staged_triangles);
+    swap(bounds, staged_bounds);
+    swap(bvh, staged_bvh);
+    staged_triangles.clear();
+}
+
+/// Closest triangle in front of the ray
+/// @param distance out: distance to it
+/// @param uv out: barycentric coordinates of the hit
+template <bool watertight, bool cull> const Triangle *Mesh::closest(const Triangle::Ray &ray, float &distance, VectorUV &uv) const {
+    distance = settings.max_render_distance;
+    const int index = bvh.closest(ray.origin, ray.direction, distance, [&](int i) { return triangles[i].distance<watertight, cull>(ray, uv); });
+    if (index < 0) return nullptr;
+    
+    // Coordinates are left over from the last triangle measured, not necessarily the closest one
+    triangles[index].distance<watertight, cull>(ray, uv);
+    return &triangles[index];
+}
+
+// Back faces are only culled for opaque materials, refracted rays leave through them
+const Triangle *Mesh::closest(Vector3 origin, Vector3 direction, float &distance, VectorUV &uv) const {
+    const Triangle::Ray ray(origin, direction);
+    const bool cull = material.cull_backfaces && !material.transparent;
     
-    const Triangle *object = nullptr;
-    ObjectHit best{(float)settings.max_render_distance, [] { return Vector3::Zero; }, [] { return Color::Black; }};
+    if (settings.watertight_triangles) return cull ? closest<true, true>(ray, distance, uv) : closest<true, false>(ray, distance, uv);
+    else return cull ? closest<false, true>(ray, distance, uv) : closest<false, false>(ray, distance, uv);
+}
+
+float Mesh::distance(Vector3 origin, Vector3 direction) const {
+    if (bounds.distance(origin, direction) < 0) return -1;
     
-    for (const auto &triangle : triangles) {
-        ObjectHit hit = triangle.intersect(origin, direction);
-        if (hit.distance < best.distance && hit.distance > 0) {
-            object = &triangle;
-            best = hit;
-        }
-    }
+    float distance;
+    VectorUV uv;
+    return closest(origin, direction, distance, uv) == nullptr ? -1 : distance;
+}
+
+ObjectHit Mesh::intersect(Vector3 origin, Vector3 direction) const {
+    if (bounds.distance(origin, direction) < 0) return {-1};
     
-    if (object == nullptr) return {-1};
+    float distance;
+    VectorUV uv;
+    const Triangle *triangle = closest(origin, direction, distance, uv);
+    if (triangle == nullptr) return {-1};
     
-    return best;
+    return triangle->intersect(distance, uv);
 }
 
 ObjectInfo Mesh::getInfo() const {
     return {(int)triangles.size() * 3, (int)triangles.size(), (int)triangles.size()};
 }
+
+/// Bytes of the source geometry, the built triangles and their hierarchy
+size_t Mesh::memory() const {
+    return (vertices.capacity() + normals.capacity()) * sizeof(array<Vector3, 3>) + textures.capacity() * sizeof(array<VectorUV, 3>) + (triangles.capacity() + staged_triangles.capacity()) * sizeof(Triangle) + bvh.memory() + staged_bvh.memory();
+}
+
+const BVH &Mesh::getBVH() const {
+    return bvh;
+}
+
+/// Closest hit queries per second with a hierarchy of the given width, rays go from around the mesh to points inside its bounds
+/// @param memory out: bytes of that hierarchy
+/// @param hits out: rays that hit a triangle
+float Mesh::benchmark(short width, int rays, size_t &memory, int &hits) const {
+    vector<Triangle> triangles;
+    Cuboid bounds({}, {}, {}, {});
+    const auto boxes = build(center, rotation, triangles, bounds);
+    BVH hierarchy;
+    hierarchy.build(boxes, settings.bvh_build, width);
+    memory = hierarchy.memory();
+    
+    Box box = Box::Empty;
+    for (const auto &it : boxes) box.extend(it);
+    const float radius = (box.max - box.min).length();
+    Random random(0, 0);
+    vector<pair<Vector3, Vector3>> samples(rays);
+    for (auto &[origin, direction] : samples) {
+        const Vector3 target = {box.min.x + (box.max.x - box.min.x) * random.uniform(), box.min.y + (box.max.y - box.min.y) * random.uniform(), box.min.z + (box.max.z - box.min.z) * random.uniform()};
+        origin = box.center() + Vector3{random.uniform() - 0.5f, random.uniform() - 0.5f, random.uniform() - 0.5f}.normalized() * radius;
+        direction = (target - origin).normalized();
+    }
+    
+    hits = 0;
+    const auto start = chrono::high_resolution_clock::now();
+    for (const auto &[origin, direction] : samples) {
+        const Triangle::Ray ray(origin, direction);
+        float distance = settings.max_render_distance;
+        VectorUV uv;
+        hits += hierarchy.closest(origin, direction, distance, [&](int i) { return triangles[i].distance<true, false>(ray, uv); }) >= 0;
+    }
+    const float seconds = chrono::duration<float>(chrono::high_resolution_clock::now() - start).count();
+    
+    return rays / seconds;
+}
+
+
+// MARK: - Primitives
+template <bool aligned> float Primitives::MeshShape::distance(Vector3 origin, Vector3 direction) const {
+    return mesh->distance(origin, direction);
+}
+
+template <class S, bool aligned> void Primitives::Group<S, aligned>::push(const S &shape, bool transparent, int index) {
+    shapes.push_back(shape);
+    this->transparent.push_back(transparent);
+    indices.push_back(index);
+}
+
+/// Keeps the closest hit, ties go to the object listed first in the scene like a single loop over all objects would
+template <class S, bool aligned> void Primitives::Group<S, aligned>::closest(Vector3 origin, Vector3 direction, bool transparent, float &distance, int &index) const {
+    for (int i = 0; i < shapes.size(); i++) {
+        if (!transparent && this->transparent[i]) continue;
+        const float t = shapes[i].template distance<aligned>(origin, direction);
+        if (t > 0 && (t < distance || (t == distance && indices[i] < index))) {
+            distance = t;
+            index = indices[i];
+        }
+    }
+}
+
+/// @return index of the first opaque object closer than length, or -1
+template <class S, bool aligned> int Primitives::Group<S, aligned>::occluder(Vector3 origin, Vector3 direction, float length, const vector<const Object *> &all, const Object *skip) const {
+    for (int i = 0; i < shapes.size(); i++) {
+        if (transparent[i]) continue;
+        const float t = shapes[i].template distance<aligned>(origin, direction);
+        if (t > 0 && t < length && all[indices[i]] != skip) return indices[i];
+    }
+    return -1;
+}
+
+Primitives::Primitives() {}
+
+/// @param objects scene objects, their order defines ids and breaks ties
+Primitives::Primitives(const vector<Object *> &objects) : all(objects.begin(), objects.end()) {
+    for (int i = 0; i < objects.size(); i++) {
+        const Object *object = objects[i];
+        const bool transparent = object->material.transparent;
+        switch (object->getType()) {
+            case OBJECT_SPHERE: spheres.push(static_cast<const Sphere *>(object)->getShape(), transparent, i); break;
+            case OBJECT_CUBOID:
+                if (object->isAligned()) aligned_cuboids.push(static_cast<const Cuboid *>(object)->getShape(), transparent, i);
+                else cuboids.push(static_cast<const Cuboid *>(object)->getShape(), transparent, i);
+                break;
+            case OBJECT_PLANE:
+                if (object->isAligned()) aligned_planes.push(static_cast<const Plane *>(object)->getShape(), transparent, i);
+                else planes.push(static_cast<const Plane *>(object)->getShape(), transparent, i);
+                break;
+            case OBJECT_MESH: meshes.push({static_cast<const Mesh *>(object)}, transparent, i); break;
+        }
+    }
+}
+
+size_t Primitives::size() const {
+    return all.size();
+}
+
+/// @param transparent whether transparent objects can be hit
+/// @param distance in: far cutoff, out: distance to the hit
+/// @param index out: position of the object in the scene, -1 for none
+/// @return object hit or nullptr
+const Object *Primitives::closest(Vector3 origin, Vector3 direction, bool transparent, float &distance, int &index) const {
+    index = -1;
+    spheres.closest(origin, direction, transparent, distance, index);
+    aligned_cuboids.closest(origin, direction, transparent, distance, index);
+    cuboids.closest(origin, direction, transparent, distance, index);
+    aligned_planes.closest(origin, direction, transparent, distance, index);
+    planes.closest(origin, direction, transparent, distance, index);
+    meshes.closest(origin, direction, transparent, distance, index);
+    
+    return index < 0 ? nullptr : all[index];
+}
+
+/// Any opaque object closer than length
+/// @param skip object that was already tested
+const Object *Primitives::occluder(Vector3 origin, Vector3 direction, float length, const Object *skip) const {
+    int index;
+    if ((index = spheres.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    if ((index = aligned_cuboids.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    if ((index = cuboids.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    if ((index = aligned_planes.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    if ((index = planes.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    if ((index = meshes.occluder(origin, direction, length, all, skip)) >= 0) return all[index];
+    return nullptr;
+}
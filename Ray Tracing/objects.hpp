@@ -15,18 +15,26 @@ class Cuboid;
 class Plane;
 class Triangle;
 class Mesh;
+class Primitives;
 
 #pragma once
 
 #include <array>
 #include <functional>
+#include <chrono>
 
 #include "settings.hpp"
 
 #include "data_types.hpp"
 #include "shaders.hpp"
+#include "animation.hpp"
+#include "bvh.hpp"
 #include "ray.hpp"
 
+enum ObjectType {
+    OBJECT_SPHERE, OBJECT_CUBOID, OBJECT_PLANE, OBJECT_MESH
+};
+
 struct ObjectInfo {
     int vertices = 0;
     int faces = 0;
@@ -38,96 +46,219 @@ struct ObjectInfo {
 struct ObjectHit {
     float distance;
     function<Vector3()> getNormal;
-    function<Color()> getTexture;
+    function<VectorUV()> getUV;
+    float uv_density = 0;
 };
 
 
 class Object {
 protected:
+    ObjectType type;
     Vector3 center;
     Matrix3x3 rotation, Irotation;
+    bool aligned;
+    
+    template <bool aligned> Vector3 toLocal(Vector3) const;
+    template <bool aligned> Vector3 toGlobal(Vector3) const;
+    
+    bool staged;
+    Vector3 staged_center;
+    Matrix3x3 staged_rotation, staged_Irotation;
     
 public:
     Material material;
+    Track track;
     
-    Object(Vector3, Vector3, Material);
+    Object(ObjectType, Vector3, Vector3, Material);
+    virtual ~Object() = default;
+    /***/ void setMaterial(Material);
+    /***/ ObjectType getType() const;
+    /***/ bool isAligned() const;
     /***/ Vector3 getCenter() const;
     /***/ Matrix3x3 getRotation() const;
     /***/ Matrix3x3 getInverseRotation() const;
     /***/ Vector3 toObjectSpace(Vector3 point) const;
     /***/ Vector3 toWorldSpace(Vector3 _point) const;
+    /***/ virtual void stageTransform(Vector3 position, Vector3 angles);
+    /***/ virtual void commitTransform();
+    /***/ virtual float distance(Vector3 origin, Vector3 direction) const = 0;
     /***/ virtual ObjectHit intersect(Vector3 origin, Vector3 direction) const = 0;
     /***/ virtual ObjectInfo getInfo() const = 0;
 };
 
 
-class Sphere : public Object {
+class Sphere final : public Object {
+public:
+    // What the distance test reads, Primitives keeps copies of it next to each other
+    struct Shape {
+        Vector3 center;
+        float radius2;
+        
+        template <bool aligned> float distance(Vector3, Vector3) const;
+    };
+    
 private:
     float radius;
-    float radius2;
+    Shape shape;
+    
+    template <bool aligned> ObjectHit intersect(Vector3, Vector3) const;
+    template <bool aligned> VectorUV getUV(Vector3) const;
     
 public:
     Sphere(Vector3, float, Vector3, Material);
+    void commitTransform();
     Vector3 getNormal(Vector3) const;
-    Color getTexture(Vector3) const;
+    float distance(Vector3, Vector3) const;
     ObjectHit intersect(Vector3, Vector3) const;
     ObjectInfo getInfo() const;
+    const Shape &getShape() const;
 };
 
 
-class Cuboid : public Object {
+class Cuboid final : public Object {
+public:
+    struct Shape {
+        Vector3 vmin, vmax, center;
+        Matrix3x3 Irotation;
+        
+        template <bool aligned> float distance(Vector3, Vector3) const;
+    };
+    
 private:
     Vector3 size;
-    Vector3 vmin, vmax;
+    Shape shape;
+    
+    template <bool aligned> ObjectHit intersect(Vector3, Vector3) const;
+    template <bool aligned> Vector3 getNormal(Vector3) const;
+    template <bool aligned> VectorUV getUV(Vector3) const;
     
 public:
     Cuboid(Vector3, float, Vector3, Material);
     Cuboid(Vector3, float, float, float, Vector3, Material);
     Cuboid(Vector3, Vector3, Vector3, Material);
-    Vector3 getNormal(Vector3) const;
-    Color getTexture(Vector3) const;
+    void commitTransform();
+    float distance(Vector3, Vector3) const;
     ObjectHit intersect(Vector3, Vector3) const;
     ObjectInfo getInfo() const;
+    const Shape &getShape() const;
 };
 
 
-class Plane : public Object {
+class Plane final : public Object {
+public:
+    struct Shape {
+        Vector3 center, axis; // World space normal
+        Matrix3x3 Irotation;
+        float size_x, size_y;
+        
+        template <bool aligned> float distance(Vector3, Vector3) const;
+    };
+    
 private:
-    float size_x, size_y;
+    Shape shape;
+    
+    template <bool aligned> ObjectHit intersect(Vector3, Vector3) const;
+    template <bool aligned> VectorUV getUV(Vector3) const;
     
 public:
     Plane(Vector3, float, float, Vector3, Material);
+    void commitTransform();
     Vector3 getNormal(Vector3) const;
-    Color getTexture(Vector3) const;
+    float distance(Vector3, Vector3) const;
     ObjectHit intersect(Vector3, Vector3) const;
     ObjectInfo getInfo() const;
+    const Shape &getShape() const;
 };
 
 
 class Triangle {
 private:
     bool vn, tc;
-    Vector3 v0, v0v1, v0v2;
+    float uv_density;
+    Vector3 v0, v1, v2;
     array<VectorUV, 3> textures;
     array<Vector3, 3> normals;
-    Material &material;
     
 public:
-    explicit Triangle(array<Vector3, 3>, array<VectorUV, 3>, array<Vector3, 3>, Material &);
+    // Ray sheared so that its direction becomes the z axis, set up once and shared by every triangle it is tested against
+    struct Ray {
+        Vector3 origin, direction;
+        int kx, ky, kz;
+        float sx, sy, sz;
+        
+        Ray(Vector3, Vector3);
+    };
+    
+    explicit Triangle(array<Vector3, 3>, array<VectorUV, 3>, array<Vector3, 3>);
     Vector3 getNormal(VectorUV) const;
-    Color getTexture(VectorUV) const;
-    ObjectHit intersect(Vector3, Vector3) const;
+    VectorUV getUV(VectorUV) const;
+    template <bool watertight, bool cull> float distance(const Ray &, VectorUV &) const;
+    ObjectHit intersect(float, VectorUV) const;
     ObjectInfo getInfo() const;
 };
 
 
-class Mesh : public Object {
+class Mesh final : public Object {
 private:
-    vector<Triangle> triangles;
-    Cuboid bounds;
+    vector<array<Vector3, 3>> vertices, normals;
+    vector<array<VectorUV, 3>> textures;
+    float scale;
+    
+    vector<Triangle> triangles, staged_triangles;
+    Cuboid bounds, staged_bounds;
+    BVH bvh, staged_bvh;
+    
+    vector<Box> build(Vector3, Matrix3x3, vector<Triangle> &, Cuboid &) const;
+    template <bool watertight, bool cull> const Triangle *closest(const Triangle::Ray &, float &, VectorUV &) const;
+    const Triangle *closest(Vector3, Vector3, float &, VectorUV &) const;
     
 public:
-    Mesh(vector<array<Vector3, 3>>, vector<array<VectorUV, 3>>, vector<array<Vector3, 3>>, Vector3, float, Vector3, Material);
+    Mesh(vector<array<Vector3, 3>>, vector<array<VectorUV, 3>>, vector<array<Vector3, 3>>, Vector3, float, Vector3, Material, short = 2);
+    void stageTransform(Vector3, Vector3);
+    void commitTransform();
+    float distance(Vector3, Vector3) const;
     ObjectHit intersect(Vector3, Vector3) const;
     ObjectInfo getInfo() const;
+    size_t memory() const;
+    const BVH &getBVH() const;
+    float benchmark(short, int, size_t &, int &) const;
+};
+
+
+// MARK: - Primitives
+// Scene objects grouped by type and by whether they are rotated, each group is an array of shapes of one type tested with direct calls
+class Primitives {
+private:
+    // Meshes traverse their own BVH, they are tested through the object
+    struct MeshShape {
+        const Mesh *mesh;
+        
+        template <bool aligned> float distance(Vector3, Vector3) const;
+    };
+    
+    template <class S, bool aligned> struct Group {
+        vector<S> shapes;
+        vector<int> indices;
+        vector<bool> transparent;
+        
+        void push(const S &, bool, int);
+        inline void closest(Vector3, Vector3, bool, float &, int &) const;
+        inline int occluder(Vector3, Vector3, float, const vector<const Object *> &, const Object *) const;
+    };
+    
+    vector<const Object *> all;
+    Group<Sphere::Shape, true> spheres;
+    Group<Cuboid::Shape, true> aligned_cuboids;
+    Group<Cuboid::Shape, false> cuboids;
+    Group<Plane::Shape, true> aligned_planes;
+    Group<Plane::Shape, false> planes;
+    Group<MeshShape, true> meshes;
+    
+public:
+    Primitives();
+    explicit Primitives(const vector<Object *> &);
+    
+    size_t size() const;
+    const Object *closest(Vector3, Vector3, bool, float &, int &) const;
+    const Object *occluder(Vector3, Vector3, float, const Object * = nullptr) const;
 };
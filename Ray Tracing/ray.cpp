@@ -29,6 +29,24 @@ void Timer::operator+=(const Timer t) {
     for (short i = 0; i < Timer::c; i++) times[i] += t.times[i];
 }
 
+// MARK: ShadowCache
+thread_local ShadowCache ShadowCache::local;
+atomic<unsigned> ShadowCache::current{0};
+
+/// Forget occluders of every thread, must be called whenever objects or lights may have been deleted
+void ShadowCache::invalidate() {
+    current++;
+}
+
+const Object *&ShadowCache::operator[](int light) {
+    if (generation != current) {
+        generation = current;
+        occluders.clear();
+    }
+    if (occluders.size() <= light) occluders.resize(light + 1, nullptr);
+    return occluders[light];
+}
+
 // MARK: RayIntersection
 Color RayIntersection::shaded() {
     if (!hit) return settings.background_color;
@@ -93,11 +111,10 @@ Vector3 refract(Vector3 direction, Vector3 normal, float ior) {
     return (k < 0 ? Vector3::Zero : direction * eta + normal * (eta * cosi - sqrt(k))).normalized();
 }
 
-// MARK: castRay
-RayIntersection castRay(Vector3 origin, Vector3 direction, const vector<Object *> &objects, const vector<Light *> &lights, RayInput mask) {
+// MARK: Shared stages
+/// Result for a ray that didn't hit anything (yet)
+inline RayIntersection emptyIntersection(Vector3 origin, const vector<Light *> &lights) {
     RayIntersection info;
-    
-    // MARK: Hit detection
     info.timer = Timer();
     info.hit = false;
     info.position = origin;
@@ -107,77 +124,377 @@ RayIntersection castRay(Vector3 origin, Vector3 direction, const vector<Object *
     info.normal = Vector3::Zero;
     info.kr = 1;
     info.shadows = vector<bool>(lights.size(), false);
-    info.diffuse = info.specular = valarray<Color>(Color::Black, objects.size());
+    info.diffuse = info.specular = valarray<Color>(Color::Black, lights.size());
     info.light = info.texture = info.reflection = info.transmission = Color::Black;
+    return info;
+}
+
+/// Closest object in front of the ray
+/// @param transparent whether transparent objects can be hit
+/// @param distance in: far cutoff, out: distance to the hit
+/// @param index out: position of the object in the scene
+/// @return object hit or nullptr
+inline const Object *closestHit(Vector3 origin, Vector3 direction, const Primitives &objects, bool transparent, float &distance, int &index, ObjectHit &hit) {
+    const Object *closest = objects.closest(origin, direction, transparent, distance, index);
+    // Only the winner builds its normal and texture coordinate lookups
+    if (closest != nullptr) hit = closest->intersect(origin, direction);
+    return closest;
+}
+
+/// Whether an opaque object blocks the way to a light, stops at the first blocker
+/// @param bounce_count bounces of the ray that is being lit
+/// @param light index of the light for the shadow cache
+inline bool occluded(Vector3 origin, Vector3 direction, float length, const Primitives &objects, short bounce_count, int light) {
+    // A ray that can't bounce anymore or doesn't reach the light counts as blocked
+    if (bounce_count + 1 > settings.max_light_bounces || settings.max_render_distance < length) return settings.max_render_distance < length;
     
-    if (++mask.bounce_count > settings.max_light_bounces) return info;
+    auto &cache = ShadowCache::local;
+    auto &occluder = cache[light];
+    cache.tests++;
+    if (occluder != nullptr && !occluder->material.transparent) {
+        const float distance = occluder->distance(origin, direction);
+        if (distance > 0 && distance < length) {
+            cache.hits++;
+            return true;
+        }
+    }
+    
+    const Object *object = objects.occluder(origin, direction, length, occluder);
+    if (object == nullptr) return false;
+    
+    occluder = object;
+    return true;
+}
+
+/// Fills the surface of a hit
+/// @param index position of the object in the scene
+inline void shadeSurface(RayIntersection &info, Vector3 direction, const Primitives &objects, int index, const RayInput &mask, const ObjectHit &hit) {
+    info.id = (float)index / objects.size();
+    info.normal = hit.getNormal();
+    info.texture = info.object->material.texture(hit.getUV(), (mask.width + mask.spread * info.distance) * hit.uv_density / max(abs(info.normal * direction), 0.1f));
+}
+
+/// Offset to avoid self-intersection
+inline void offsetSurface(RayIntersection &info, Vector3 direction) {
+    if (info.normal * direction < 0 && info.object->material.transparent) info.position -= info.normal * settings.surface_bias;
+    else info.position += info.normal * settings.surface_bias;
+}
+
+/// Diffuse and specular values of one light, without shadows
+inline void lightSurface(RayIntersection &info, Vector3 direction, Light *light, int i) {
+    if (info.object->material.Ks < 1) info.diffuse[i] = light->getDiffuseValue(info.position, info.normal);
+    if (info.object->material.Ks > 0) info.specular[i] = light->getSpecularValue(info.position, info.normal, direction, info.object->material.n);
+}
+
+/// Lights that may reach the surface, in scene order
+inline const vector<int> &relevantLights(const RayIntersection &info, const RayInput &mask, size_t count) {
+    if (mask.culling != nullptr) return mask.culling->query(info.position, info.object->material.Ks > 0);
+    
+    static thread_local vector<int> all;
+    if (all.size() != count) {
+        all.resize(count);
+        iota(all.begin(), all.end(), 0);
+    }
+    return all;
+}
+
+/// Drops a light that contributes too little to be worth a shadow ray
+inline bool negligible(RayIntersection &info, int i) {
+    if (settings.light_threshold <= 0) return false;
+    
+    const Color contribution = info.diffuse[i] * (1 - info.object->material.Ks) + info.specular[i] * info.object->material.Ks;
+    if (max({contribution.r, contribution.g, contribution.b}) >= settings.light_threshold) return false;
+    
+    info.diffuse[i] = info.specular[i] = Color::Black;
+    return true;
+}
+
+/// Keeps light_samples of the lights that need a shadow ray, picked with probability proportional to their contribution and reweighted so the expected result doesn't change
+/// @param mask keys the random picks, so they are the same whatever thread or order the ray is traced in
+/// @param tested lights that need a shadow ray, replaced by the ones picked
+inline void sampleLights(RayIntersection &info, const RayInput &mask, vector<int> &tested) {
+    if (settings.light_samples <= 0 || tested.size() <= settings.light_samples) return;
+    
+    const float Ks = info.object->material.Ks;
+    vector<float> weights(tested.size());
+    for (int j = 0; j < tested.size(); j++) weights[j] = (info.diffuse[tested[j]] * (1 - Ks) + info.specular[tested[j]] * Ks).asValue();
     
+    vector<float> cumulative(tested.size());
+    partial_sum(weights.begin(), weights.end(), cumulative.begin());
+    const float total = cumulative.back();
+    if (total <= 0) return;
+    
+    // A product rounded up to total falls past the end, it goes to the last light that can be picked
+    const long last = find_if(weights.rbegin(), weights.rend(), [](float w) { return w > 0; }).base() - weights.begin() - 1;
+    
+    Random random(mask.x, mask.y, mask.sample, mask.path);
+    vector<int> picked(tested.size(), 0);
+    for (int s = 0; s < settings.light_samples; s++) {
+        const auto it = upper_bound(cumulative.begin(), cumulative.end(), random.uniform() * total);
+        picked[min<long>(it - cumulative.begin(), last)]++;
+    }
+    
+    vector<int> kept;
+    for (int j = 0; j < tested.size(); j++) {
+        const int i = tested[j];
+        const float weight = picked[j] > 0 ? picked[j] * total / (settings.light_samples * weights[j]) : 0;
+        info.diffuse[i] = info.diffuse[i] * weight;
+        info.specular[i] = info.specular[i] * weight;
+        if (picked[j] > 0) kept.push_back(i);
+    }
+    tested = move(kept);
+}
+
+/// @param transmitted whether the ray is refracted or reflected
+inline RayInput secondaryMask(RayInput mask, size_t lights, float distance, bool transmitted) {
+    mask.diffuse = mask.reflections = mask.transmission = true;
+    mask.shadows = vector<bool>(lights, true);
+    mask.width = mask.width + mask.spread * distance;
+    mask.path = mask.path << 1 | transmitted;
+    return mask;
+}
+
+// MARK: tracePrimary
+/// Intersects a camera ray and fills its G-buffer entry
+/// @param primary entry to fill, footprint is based on its width and spread
+void tracePrimary(Vector3 origin, Vector3 direction, const Primitives &objects, RayInput mask, PrimaryHit &primary) {
     ObjectHit hit;
-    for (const auto &object : objects) {
-        ObjectHit temp = object->intersect(origin, direction);
-        if (temp.distance > 0 && temp.distance < info.distance && (mask.lighting || !object->material.transparent)) {
-            info.object = object;
-            info.distance = temp.distance;
-            hit = temp;
-        }
+    int index;
+    float distance = settings.max_render_distance;
+    const Object *closest = closestHit(origin, direction, objects, true, distance, index, hit);
+    
+    if (closest == nullptr) {
+        primary = {true, nullptr};
+        return;
     }
     
+    const float id = (float)index / objects.size();
+    const Vector3 normal = hit.getNormal();
+    const float footprint = (mask.width + mask.spread * distance) * hit.uv_density / max(abs(normal * direction), 0.1f);
+    primary = {true, closest, id, distance, origin + direction * distance, normal, hit.getUV(), footprint};
+}
+
+// MARK: castRay
+/// @param primary G-buffer entry for camera rays, traced first if not cached yet
+/// @param texture surface color if it was already evaluated in a batch
+RayIntersection castRay(Vector3 origin, Vector3 direction, const Primitives &objects, const vector<Light *> &lights, RayInput mask, PrimaryHit *primary, const Color *texture) {
+    RayIntersection info = emptyIntersection(origin, lights);
+    
+    // MARK: Hit detection
+    if (++mask.bounce_count > settings.max_light_bounces) return info;
+    info.rays = 1;
+    
+    ObjectHit hit;
+    int index;
+    if (primary != nullptr && !primary->cached) tracePrimary(origin, direction, objects, mask, *primary);
+    const bool cached = primary != nullptr;
+    if (cached) {
+        // Shade from the G-buffer without tracing the camera ray again
+        info.object = primary->object;
+        if (info.object != nullptr) info.distance = primary->distance;
+    } else info.object = closestHit(origin, direction, objects, mask.lighting, info.distance, index, hit);
+    
     info.position = origin + direction * info.distance;
     if ((info.hit = info.object != nullptr)) {
         // Return if only testing for clear line of sight
         if (!mask.lighting) return info;
         
-        info.id = (float)distance(objects.begin(), find(objects.begin(), objects.end(), info.object)) / objects.size();
-        info.normal = hit.getNormal();
-        info.texture = hit.getTexture();
+        if (cached) {
+            info.id = primary->id;
+            info.position = primary->position;
+            info.normal = primary->normal;
+            info.texture = texture != nullptr ? *texture : info.object->material.texture(primary->uv, primary->footprint);
+        } else shadeSurface(info, direction, objects, index, mask, hit);
         
-        // Offset to avoid self-intersection
-        if (info.normal * direction < 0 && info.object->material.transparent) info.position -= info.normal * settings.surface_bias;
-        else info.position += info.normal * settings.surface_bias;
+        offsetSurface(info, direction);
     } else return info;
     
     // MARK: Diffuse, Specular
     info.timer();
     if (mask.diffuse && !info.object->material.transparent) {
-        auto shadow_mask = mask;
-        shadow_mask.lighting = false;
-        for (int i = 0; i < lights.size(); i++) {
-            const auto &light = lights[i];
-            
-            if (info.object->material.Ks < 1) info.diffuse[i] = light->getDiffuseValue(info.position, info.normal);
-            if (info.object->material.Ks > 0) info.specular[i] = light->getSpecularValue(info.position, info.normal, direction, info.object->material.n);
-            
-            // Check clear line of sight to light
-            const auto vector_to_light = light->getVector(info.position);
-            if (mask.shadows[i] && light->shadow && castRay(info.position, vector_to_light.normalized(), objects, lights, shadow_mask).distance < vector_to_light.length()) {
-                info.shadows[i] = true;
-                continue;
-            }
-            
-            info.light += info.diffuse[i] * (1 - info.object->material.Ks) + info.specular[i] * info.object->material.Ks;
+        const auto &relevant = relevantLights(info, mask, lights.size());
+        vector<int> tested;
+        for (const int i : relevant) {
+            lightSurface(info, direction, lights[i], i);
+            if (!negligible(info, i) && mask.shadows[i] && lights[i]->shadow) tested.push_back(i);
         }
+        sampleLights(info, mask, tested);
+        
+        // Check clear line of sight to lights
+        info.rays += tested.size();
+        for (const int i : tested) {
+            const auto vector_to_light = lights[i]->getVector(info.position);
+            info.shadows[i] = occluded(info.position, vector_to_light.normalized(), vector_to_light.length(), objects, mask.bounce_count, i);
+        }
+        
+        for (const int i : relevant) if (!info.shadows[i]) info.light += info.diffuse[i] * (1 - info.object->material.Ks) + info.specular[i] * info.object->material.Ks;
     }
     
     // MARK: Reflection
     info.timer();
-    auto reflect_mask = mask;
-    reflect_mask.diffuse = reflect_mask.reflections = reflect_mask.transmission = true;
-    reflect_mask.shadows = vector<bool>(lights.size(), true);
-    
     if (mask.reflections && (info.object->material.Ks > 0 || info.object->material.transparent)) {
-        auto ray = castRay(info.position, reflect(direction, info.normal), objects, lights, reflect_mask);
+        auto ray = castRay(info.position, reflect(direction, info.normal), objects, lights, secondaryMask(mask, lights.size(), info.distance, false));
         info.reflection = ray.shaded();
+        info.rays += ray.rays;
     }
     
     // MARK: Transmission
     info.timer();
     if (info.object->material.transparent) {    // Nested ifs to fill info.kr but not waste computation
         if ((info.kr = fresnel(direction, info.normal, info.object->material.ior)) < 1 && mask.transmission) {
-            auto ray = castRay(info.position, refract(direction, info.normal, info.object->material.ior), objects, lights, reflect_mask);
+            auto ray = castRay(info.position, refract(direction, info.normal, info.object->material.ior), objects, lights, secondaryMask(mask, lights.size(), info.distance, true));
             info.transmission = ray.shaded();
+            info.rays += ray.rays;
         }
     }
     
     info.timer();
     return info;
 }
+
+// MARK: castWavefront
+/// Breadth-first alternative to castRay for a batch of camera rays, gives the same results
+/// Every bounce is one wave: rays of the wave are intersected together, their shadow rays are queued and traced together and reflected and refracted rays are queued for the next wave. Finished rays are dropped from the wave, their colors are combined back into their parents once all waves are done
+/// @param pixels pixel of every camera ray, keys its random numbers
+/// @param primaries G-buffer entries of the camera rays, all cached
+/// @param textures surface colors of the camera rays
+/// @param timer receives time spent per stage
+vector<RayIntersection> castWavefront(Vector3 origin, const vector<Vector3> &directions, const vector<array<unsigned, 2>> &pixels, const Primitives &objects, const vector<Light *> &lights, RayInput mask, const vector<PrimaryHit *> &primaries, const vector<Color> &textures, Timer &timer) {
+    enum Kind { CAMERA, REFLECTED, TRANSMITTED };
+    struct Path {
+        int parent;
+        Kind kind;
+        Vector3 origin, direction;
+        RayInput mask;
+        RayIntersection info;
+    };
+    struct ShadowRay {
+        int path, light;
+        Vector3 direction;
+        float length;
+    };
+    
+    // Parents always come before their children
+    vector<Path> paths;
+    paths.reserve(directions.size() * 2);
+    for (int i = 0; i < directions.size(); i++) {
+        paths.push_back({-1, CAMERA, origin, directions[i], mask});
+        paths.back().mask.x = pixels[i][0];
+        paths.back().mask.y = pixels[i][1];
+    }
+    
+    vector<int> wave(directions.size());
+    iota(wave.begin(), wave.end(), 0);
+    vector<ShadowRay> shadows;
+    vector<int> tested;
+    
+    auto start = chrono::high_resolution_clock::now();
+    const auto lap = [&start](float &time) {
+        const auto now = chrono::high_resolution_clock::now();
+        time += chrono::duration<float, milli>(now - start).count();
+        start = now;
+    };
+    
+    while (!wave.empty()) {
+        // MARK: Intersect, compact
+        int alive = 0;
+        for (const int p : wave) {
+            Path &path = paths[p];
+            auto &info = path.info = emptyIntersection(path.origin, lights);
+            
+            if (++path.mask.bounce_count <= settings.max_light_bounces) {
+                info.rays = 1;
+                ObjectHit hit;
+                int index;
+                if (path.kind == CAMERA) {
+                    info.object = primaries[p]->object;
+                    if (info.object != nullptr) info.distance = primaries[p]->distance;
+                } else info.object = closestHit(path.origin, path.direction, objects, true, info.distance, index, hit);
+                
+                info.position = path.origin + path.direction * info.distance;
+                if ((info.hit = info.object != nullptr)) {
+                    if (path.kind == CAMERA) {
+                        info.id = primaries[p]->id;
+                        info.position = primaries[p]->position;
+                        info.normal = primaries[p]->normal;
+                        info.texture = textures[p];
+                    } else shadeSurface(info, path.direction, objects, index, path.mask, hit);
+                    
+                    offsetSurface(info, path.direction);
+                    wave[alive++] = p;
+                }
+            }
+            
+            lap(timer.times[path.kind == TRANSMITTED ? 3 : path.kind == REFLECTED ? 2 : 0]);
+        }
+        wave.resize(alive);
+        
+        // MARK: Shadows
+        shadows.clear();
+        for (const int p : wave) {
+            Path &path = paths[p];
+            if (!path.mask.diffuse || path.info.object->material.transparent) continue;
+            
+            tested.clear();
+            for (const int i : relevantLights(path.info, path.mask, lights.size())) {
+                lightSurface(path.info, path.direction, lights[i], i);
+                if (!negligible(path.info, i) && path.mask.shadows[i] && lights[i]->shadow) tested.push_back(i);
+            }
+            sampleLights(path.info, path.mask, tested);
+            path.info.rays += tested.size();
+            
+            for (const int i : tested) {
+                const auto vector_to_light = lights[i]->getVector(path.info.position);
+                shadows.push_back({p, i, vector_to_light.normalized(), vector_to_light.length()});
+            }
+        }
+        
+        for (const auto &shadow : shadows) {
+            const Path &path = paths[shadow.path];
+            if (occluded(path.info.position, shadow.direction, shadow.length, objects, path.mask.bounce_count, shadow.light)) paths[shadow.path].info.shadows[shadow.light] = true;
+        }
+        
+        for (const int p : wave) {
+            auto &info = paths[p].info;
+            if (!paths[p].mask.diffuse || info.object->material.transparent) continue;
+            for (const int i : relevantLights(info, paths[p].mask, lights.size())) if (!info.shadows[i]) info.light += info.diffuse[i] * (1 - info.object->material.Ks) + info.specular[i] * info.object->material.Ks;
+        }
+        lap(timer.times[1]);
+        
+        // MARK: Reflection, Transmission
+        vector<int> next;
+        for (const int p : wave) {
+            // Appending may move paths, so nothing is held by reference
+            const Material &material = paths[p].info.object->material;
+            const Vector3 position = paths[p].info.position, normal = paths[p].info.normal, direction = paths[p].direction;
+            const bool reflections = paths[p].mask.reflections, transmission = paths[p].mask.transmission;
+            const RayInput mask = paths[p].mask;
+            const float distance = paths[p].info.distance;
+            
+            if (reflections && (material.Ks > 0 || material.transparent)) {
+                next.push_back((int)paths.size());
+                paths.push_back({p, REFLECTED, position, reflect(direction, normal), secondaryMask(mask, lights.size(), distance, false)});
+            }
+            
+            if (material.transparent) {
+                if ((paths[p].info.kr = fresnel(direction, normal, material.ior)) < 1 && transmission) {
+                    next.push_back((int)paths.size());
+                    paths.push_back({p, TRANSMITTED, position, refract(direction, normal, material.ior), secondaryMask(mask, lights.size(), distance, true)});
+                }
+            }
+        }
+        wave = move(next);
+    }
+    
+    // MARK: Combine
+    for (int p = (int)paths.size() - 1; p >= directions.size(); p--) {
+        auto &parent = paths[paths[p].parent].info;
+        (paths[p].kind == REFLECTED ? parent.reflection : parent.transmission) = paths[p].info.shaded();
+        parent.rays += paths[p].info.rays;
+    }
+    lap(timer.times[2]);
+    
+    vector<RayIntersection> result(directions.size());
+    for (int i = 0; i < directions.size(); i++) result[i] = move(paths[i].info);
+    return result;
+}
@@ -8,12 +8,16 @@
 
 struct Timer;
 struct RayInput;
+struct PrimaryHit;
 struct RayIntersection;
+struct ShadowCache;
 
 #pragma once
 
 #include <vector>
 #include <valarray>
+#include <numeric>
+#include <atomic>
 
 #include "settings.hpp"
 
@@ -28,7 +32,7 @@ struct Timer {
     static const array<string, c> names;
     static const array<Color, c> colors;
     
-    chrono::steady_clock::time_point start;
+    chrono::high_resolution_clock::time_point start;
     short last;
     array<float, c> times;
     
@@ -44,6 +48,38 @@ struct RayInput {
     
     bool lighting, diffuse, reflections, transmission;
     vector<bool> shadows;
+    
+    // Ray cone, footprint width at the origin and its growth per unit of distance
+    float width = 0, spread = 0;
+    
+    // Lights worth evaluating, all of them if not set
+    const LightGrid *culling = nullptr;
+    
+    // Key of the ray's random numbers: pixel, sample and the path of bounces from the camera ray (1), reflections append a 0 bit and transmissions a 1
+    unsigned x = 0, y = 0, sample = 0, path = 1;
+};
+
+// G-buffer entry, everything about a camera ray that doesn't depend on materials or lights
+struct PrimaryHit {
+    bool cached = false;
+    const Object *object = nullptr;
+    float id, distance;
+    Vector3 position, normal;
+    VectorUV uv;
+    float footprint;
+};
+
+// Last object found blocking each light, tested first since neighbouring shadow rays are usually blocked by the same one
+struct ShadowCache {
+    unsigned generation = 0;
+    vector<const Object *> occluders;
+    unsigned long tests = 0, hits = 0;
+    
+    static thread_local ShadowCache local;
+    static atomic<unsigned> current;
+    
+    static void invalidate();
+    const Object *&operator[](int);
 };
 
 struct RayIntersection {
@@ -62,6 +98,9 @@ struct RayIntersection {
     Color shaded();
     
     Timer timer;
+    unsigned rays = 0; // Traced for this one, shadow rays and bounces included
 };
 
-RayIntersection castRay(Vector3, Vector3, const vector<Object *> &, const vector<Light *> &, RayInput mask);
+void tracePrimary(Vector3, Vector3, const Primitives &, RayInput, PrimaryHit &);
+RayIntersection castRay(Vector3, Vector3, const Primitives &, const vector<Light *> &, RayInput mask, PrimaryHit *primary = nullptr, const Color *texture = nullptr);
+vector<RayIntersection> castWavefront(Vector3, const vector<Vector3> &, const vector<array<unsigned, 2>> &, const Primitives &, const vector<Light *> &, RayInput, const vector<PrimaryHit *> &, const vector<Color> &, Timer &);
@@ -43,6 +43,22 @@ inline Color getPixel(RayIntersection data, int mode) {
     }
 }
 
+// MARK: Skip what render_mode doesn't show
+inline void maskRenderMode(RayInput &mask) {
+    switch (settings.render_mode) {
+        case RENDER_REFLECTION: if (!mask.reflections) mask.render = false; mask.diffuse = mask.transmission = false; break;
+        case RENDER_TRANSMISSION: if (!mask.transmission) mask.render = false; mask.diffuse = mask.reflections = false; break;
+        case RENDER_LIGHT:
+        case RENDER_SHADOWS: mask.reflections = mask.transmission = false; break;
+        case RENDER_COLOR:
+        case RENDER_NORMALS:
+        case RENDER_INORMALS:
+        case RENDER_DEPTH:
+        case RENDER_UNIQUE: mask.diffuse = mask.reflections = mask.transmission = false;
+        case RENDER_SHADED: break;
+    }
+}
+
 Renderer::Renderer(NativeInterface &display, Camera &camera, vector<Object *> &objects, vector<Light *> &lights) : display(display), camera(camera), objects(objects), lights(lights) {
     width = height = 0;
 }
@@ -53,15 +69,21 @@ vector<vector<RayIntersection>> Renderer::preRender() {
     const int regions_y = ceil((float)height / settings.render_region_size);
     
     vector<vector<RayIntersection>> buffer(regions_x, vector<RayIntersection>(regions_y));
-    if (!settings.preprocess) return buffer;
+    if (!settings.preprocess && !settings.cost_scheduling) return buffer;
     
     for (int x = 0; x < regions_x; x++) {
         for (int y = 0; y < regions_y; y++) {
-            buffer[x][y] = castRay(camera.getPosition(), camera.getRay((x + 0.5) * settings.render_region_size, (y + 0.5) * settings.render_region_size), objects, lights, {true, 0, true, true, true, true, vector<bool>(objects.size(), true)});
+            RayInput mask{true, 0, true, true, true, true, vector<bool>(lights.size(), true)};
+            mask.x = (x + 0.5) * settings.render_region_size;
+            mask.y = (y + 0.5) * settings.render_region_size;
+            buffer[x][y] = castRay(camera.getPosition(), camera.getRay(mask.x, mask.y), primitives, lights, mask);
             
-            for (int dx = 0; dx < settings.render_region_size; dx++) {
-                if (settings.save_render) for (auto mode = 0; mode < RenderTypes; mode++) fill(&result[mode][x * settings.render_region_size + dx][y * settings.render_region_size], &result[mode][x * settings.render_region_size + dx][(y + 1) * settings.render_region_size], getPixel(buffer[x][y], mode));
-                for (int dy = 0; dy < settings.render_region_size; dy++) display.drawPixel(x * settings.render_region_size + dx, y * settings.render_region_size + dy, getPixel(buffer[x][y], settings.render_mode));
+            const auto pixel = getPixel(buffer[x][y], settings.render_mode);
+            for (int dx = x * settings.render_region_size; dx < min((x + 1) * settings.render_region_size, width); dx++) {
+                for (int dy = y * settings.render_region_size; dy < min((y + 1) * settings.render_region_size, height); dy++) {
+                    result[dx][dy] = pixel;
+                    display.drawPixel(dx, dy, pixel);
+                }
             }
         }
     }
@@ -76,6 +98,7 @@ vector<vector<RayInput>> Renderer::processPreRender(const vector<vector<RayInter
     
     vector<vector<RayInput>> processed(buffer.size(), vector<RayInput>(buffer[0].size(), RayInput{true, 0, true, true, true, true, vector<bool>(lights.size(), true)}));
     if (!settings.preprocess) {
+        for (auto &column : processed) for (auto &mask : column) maskRenderMode(mask);
         region_count = regions_x * regions_y;
         return processed;
     } else region_count = 0;
@@ -121,16 +144,7 @@ vector<vector<RayInput>> Renderer::processPreRender(const vector<vector<RayInter
                 
                 for (int i = 0; i < processed[x][y].shadows.size(); i++) processed[x][y].shadows[i] = edge_filter.eval(shadow_matrix[i])[0];
                 
-                switch (settings.render_mode) {
-                    case RENDER_REFLECTION: if (!processed[x][y].reflections) processed[x][y].render = false; processed[x][y].diffuse = processed[x][y].transmission = false; break;
-                    case RENDER_TRANSMISSION: if (!processed[x][y].transmission) processed[x][y].render = false; processed[x][y].diffuse = processed[x][y].reflections = false; break;
-                    case RENDER_LIGHT:
-                    case RENDER_SHADOWS: processed[x][y].reflections = processed[x][y].transmission = false; break;
-                    case RENDER_COLOR:
-                    case RENDER_NORMALS:
-                    case RENDER_DEPTH: processed[x][y].diffuse = processed[x][y].reflections = processed[x][y].transmission = false;
-                    case RENDER_SHADED: break;
-                }
+                maskRenderMode(processed[x][y]);
                 
                 if (processed[x][y].render) {
                     region_count++;
@@ -149,32 +163,92 @@ void Renderer::renderInfo() {
     static const vector<string> render_type_names = {"Shaded", "Textures", "Reflections", "Transmission", "Light", "Shadows", "Normals", "Inverse Normals", "Depth", "Objects"};
     
     if (region_current < region_count) end = chrono::high_resolution_clock::now();
-    display.renderInfo({region_current, region_count, (int)chrono::duration<float, milli>(end - start).count(), info.objects, timer, render_type_names[settings.render_mode]});
+    display.renderInfo({region_current, region_count, (int)chrono::duration<float, milli>(end - start).count(), info.objects, timer, render_type_names[settings.render_mode], shadow_tests, shadow_hits});
     
     display.refresh();
 }
 
-RenderRegion Renderer::renderRegion(RenderRegion region, const RayInput &mask, const RayIntersection &estimate) {
-    for (int x = 0; x < region.w; x++) {
-        for (int y = 0; y < region.h; y++) {
-            auto ray = castRay(camera.getPosition(), camera.getRay(region.x + x, region.y + y), objects, lights, mask);
-            
-            if (!mask.reflections && ray.hit && ray.object->material.Ks) ray.reflection = estimate.reflection == Color::Black ? settings.background_color : estimate.reflection;
-            if (!mask.transmission && ray.hit && ray.object->material.transparent) ray.transmission = estimate.transmission == Color::Black ? settings.background_color : estimate.transmission;
-            for (int i = 0; i < mask.shadows.size(); i++) if (!mask.shadows[i] && ray.hit) if ((ray.shadows[i] = estimate.shadows[i])) ray.light = estimate.light;
-            
-            region.buffer[x][y] = getPixel(ray, settings.render_mode);
-            region.timer += ray.timer;
-            
-            if (!settings.save_render) continue;
-            for (auto mode = 0; mode < RenderTypes; mode++) result[mode][region.x + x][region.y + y] = getPixel(ray, mode);
+/// Shades in stages over the whole region: camera rays are intersected first, then hits are grouped by shader so textures are evaluated in batches and lighting runs over one shader at a time
+RenderRegion Renderer::renderRegion(RenderRegion region, RayInput mask, const RayIntersection &estimate) {
+    mask.spread = camera.getSpread();
+    mask.culling = &light_grid;
+    const auto shadow_tests = ShadowCache::local.tests, shadow_hits = ShadowCache::local.hits;
+    const int count = region.w * region.h;
+    
+    // MARK: Intersect
+    auto intersections = chrono::high_resolution_clock::now();
+    vector<PrimaryHit> local(settings.save_render ? 0 : count);
+    vector<PrimaryHit *> hits(count);
+    vector<Vector3> directions(count);
+    vector<array<unsigned, 2>> pixels(count);
+    for (int i = 0; i < count; i++) {
+        const int x = region.x + i / region.h, y = region.y + i % region.h;
+        pixels[i] = {(unsigned)x, (unsigned)y};
+        hits[i] = settings.save_render ? &gbuffer[x][y] : &local[i];
+        directions[i] = camera.getRay(x, y);
+        if (!hits[i]->cached) tracePrimary(camera.getPosition(), directions[i], primitives, mask, *hits[i]);
+    }
+    region.timer.times[0] += chrono::duration<float, milli>(chrono::high_resolution_clock::now() - intersections).count();
+    
+    // MARK: Sort by shader
+    // Objects hold their own copy of the material, hits are grouped by the shader it was parsed from instead
+    vector<int> order;
+    order.reserve(count);
+    for (int i = 0; i < count; i++) if (hits[i]->object != nullptr) order.push_back(i);
+    stable_sort(order.begin(), order.end(), [&hits](int a, int b) { return hits[a]->object->material.texture.identity() < hits[b]->object->material.texture.identity(); });
+    
+    // MARK: Textures
+    vector<Color> textures(count);
+    vector<VectorUV> uvs(order.size());
+    vector<float> footprints(order.size());
+    for (int i = 0; i < order.size(); i++) {
+        uvs[i] = hits[order[i]]->uv;
+        footprints[i] = hits[order[i]]->footprint;
+    }
+    
+    vector<Color> batch(order.size());
+    for (int begin = 0, end; begin < order.size(); begin = end) {
+        const Shader &shader = hits[order[begin]]->object->material.texture;
+        for (end = begin + 1; end < order.size() && hits[order[end]]->object->material.texture.identity() == shader.identity(); end++);
+        shader(&uvs[begin], &footprints[begin], &batch[begin], end - begin);
+    }
+    for (int i = 0; i < order.size(); i++) textures[order[i]] = batch[i];
+    
+    // MARK: Shade, misses last
+    vector<RayIntersection> rays;
+    if (settings.wavefront) rays = castWavefront(camera.getPosition(), directions, pixels, primitives, lights, mask, hits, textures, region.timer);
+    else {
+        rays.resize(count);
+        for (int i = 0; i < count; i++) if (hits[i]->object == nullptr) order.push_back(i);
+        for (const int i : order) {
+            mask.x = pixels[i][0];
+            mask.y = pixels[i][1];
+            rays[i] = castRay(camera.getPosition(), directions[i], primitives, lights, mask, hits[i], &textures[i]);
+            region.timer += rays[i].timer;
         }
     }
     
+    for (int i = 0; i < count; i++) {
+        auto &ray = rays[i];
+        
+        if (!mask.reflections && ray.hit && ray.object->material.Ks) ray.reflection = estimate.reflection == Color::Black ? settings.background_color : estimate.reflection;
+        if (!mask.transmission && ray.hit && ray.object->material.transparent) ray.transmission = estimate.transmission == Color::Black ? settings.background_color : estimate.transmission;
+        for (int l = 0; l < mask.shadows.size(); l++) if (!mask.shadows[l] && ray.hit) if ((ray.shadows[l] = estimate.shadows[l])) ray.light = estimate.light;
+        
+        region.buffer[i / region.h][i % region.h] = getPixel(ray, settings.render_mode);
+    }
+    
+    region.shadow_tests = ShadowCache::local.tests - shadow_tests;
+    region.shadow_hits = ShadowCache::local.hits - shadow_hits;
     return region;
 }
 
 // MARK: Main loop
+/// Forget the G-buffer, must be called whenever the camera or geometry changes
+void Renderer::invalidate() {
+    gbuffer.clear();
+}
+
 void Renderer::render() {
     start = chrono::high_resolution_clock::now();
     
@@ -185,7 +259,14 @@ void Renderer::render() {
     resetPosition();
     
     for (const auto &object : objects) info += object->getInfo();
-    if (settings.save_render) result = vector<Buffer>(RenderTypes, Buffer(width, vector<Color>(height, Color::Black)));
+    if (!settings.save_render) gbuffer.clear();
+    else if (gbuffer.size() != width || gbuffer.empty() || gbuffer[0].size() != height) gbuffer = vector<vector<PrimaryHit>>(width, vector<PrimaryHit>(height));
+    result = Buffer(width, vector<Color>(height, settings.background_color));
+    TextureCache::trim((size_t)settings.texture_memory << 20);
+    primitives = Primitives(objects);
+    light_grid = LightGrid(lights, settings.light_threshold);
+    ShadowCache::invalidate();
+    shadow_tests = shadow_hits = 0;
     
     display.log("Starting render...");
     
@@ -199,9 +280,9 @@ void Renderer::render() {
     
     // Create job queue
     ConcurrentQueue<RenderRegion> task_queue;
-    do {
-        task_queue.push(RenderRegion(minX, maxX, minY, maxY));
-    } while (next(mask));
+    const auto regions = scheduleRegions(mask, buffer);
+    for (const auto &region : regions) task_queue.push(region);
+    region_count = (int)regions.size();
     renderInfo();
     
     // Create job lambda
@@ -219,16 +300,22 @@ void Renderer::render() {
     vector<thread> threads(settings.rendering_threads);
     for (auto &it : threads) it = thread(func);
     
-    // Use main thread to render results
-    do {
+    // Use main thread to render results, the window is redrawn at most 30 times a second
+    auto refresh = chrono::high_resolution_clock::now();
+    while (region_current < region_count) {
         RenderRegion region;
         result_queue.pop(region);
-        for (int x = 0; x < region.w; x++) for (int y = 0; y < region.h; y++) display.drawPixel(region.x + x, region.y + y, region.buffer[x][y]);
+        for (int x = 0; x < region.w; x++) for (int y = 0; y < region.h; y++) display.drawPixel(region.x + x, region.y + y, result[region.x + x][region.y + y] = region.buffer[x][y]);
         
         timer += region.timer;
+        shadow_tests += region.shadow_tests;
+        shadow_hits += region.shadow_hits;
         region_current++;
-        renderInfo();
-    } while (region_current < region_count);
+        if (region_current == region_count || (int)chrono::duration<float, milli>(chrono::high_resolution_clock::now() - refresh).count() > 33) {
+            renderInfo();
+            refresh = chrono::high_resolution_clock::now();
+        }
+    }
     
     // Terminate sibling threads
     task_queue.stop();
@@ -243,9 +330,11 @@ void Renderer::render() {
         int x = task.x / settings.render_region_size, y = task.y / settings.render_region_size;
         
         RenderRegion region = renderRegion(task, mask[x][y], buffer[x][y]);
-        for (int x = 0; x < region.w; x++) for (int y = 0; y < region.h; y++) display.drawPixel(region.x + x, region.y + y, region.buffer[x][y]);
+        for (int x = 0; x < region.w; x++) for (int y = 0; y < region.h; y++) display.drawPixel(region.x + x, region.y + y, result[region.x + x][region.y + y] = region.buffer[x][y]);
         
         timer += region.timer;
+        shadow_tests += region.shadow_tests;
+        shadow_hits += region.shadow_hits;
         region_current++;
         if ((int)chrono::duration<float, milli>(chrono::high_resolution_clock::now() - refresh).count() > 1000) {
             renderInfo();
@@ -257,14 +346,87 @@ void Renderer::render() {
 #endif
     
     for (short i = 0; i < timer.c; i++) display.log("Calculating " + timer.names[i] + " took " + to_string(timer.times[i] / 1000.f) + " seconds");
+    if (shadow_tests > 0) display.log("Shadow cache answered " + to_string(100 * shadow_hits / shadow_tests) + "% of " + to_string(shadow_tests) + " shadow rays");
+    display.log("Textures use " + to_string(TextureCache::usage() >> 10) + " kB");
     display.log("Total time was " + to_string(chrono::duration<float, milli>(end - start).count() / 1000.f) + " seconds");
 }
 
-Buffer Renderer::getResult(short layer) {
-    return result[layer];
+// MARK: - Animation
+void Renderer::stageFrame(int frame) {
+    for (const auto &object : objects) {
+        if (object->track.empty()) continue;
+        const auto keyframe = object->track(frame);
+        object->stageTransform(keyframe.position, keyframe.rotation);
+    }
+}
+
+void Renderer::commitFrame() {
+    for (const auto &object : objects) object->commitTransform();
+}
+
+void Renderer::renderSequence(const Animation &animation) {
+    stageFrame(0);
+    for (int frame = 0; frame < animation.frames; frame++) {
+        commitFrame();
+        if (!camera.track.empty()) {
+            const auto keyframe = camera.track(frame);
+            camera.setTransform(keyframe.position, keyframe.rotation);
+        }
+        
+        display.log("Rendering frame " + to_string(frame + 1) + "/" + to_string(animation.frames));
+        invalidate();
+        
+#ifndef __EMSCRIPTEN__
+        // Set up the next frame while this one renders
+        thread setup;
+        if (frame + 1 < animation.frames) setup = thread(&Renderer::stageFrame, this, frame + 1);
+        
+        render();
+        
+        if (setup.joinable()) setup.join();
+#else
+        render();
+        if (frame + 1 < animation.frames) stageFrame(frame + 1);
+#endif
+        
+        stringstream filename;
+        filename << animation.output << '_' << setfill('0') << setw(4) << frame << ".png";
+        if (!display.saveImage(filename.str(), getResult())) display.log("Unable to save " + filename.str());
+    }
+}
+
+Buffer Renderer::getResult() {
+    return result;
 }
 
 // MARK: - Region management
+/// Region at position d along a Hilbert curve, neighbors on the curve are neighbors in the image
+/// @param side of the square grid the curve fills, a power of 2
+inline void hilbertRegion(int side, int d, int &x, int &y) {
+    x = y = 0;
+    for (int s = 1; s < side; s *= 2, d /= 4) {
+        const int rx = 1 & (d / 2), ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+    }
+}
+
+/// Region at position d along a Morton curve, bits of d alternate between x and y
+inline void mortonRegion(int d, int &x, int &y) {
+    x = y = 0;
+    for (int bit = 0; d >> 2 * bit; bit++) {
+        x |= (d >> 2 * bit & 1) << bit;
+        y |= (d >> (2 * bit + 1) & 1) << bit;
+    }
+}
+
 void Renderer::generateRange() {
     minX = fmax(x, 0);
     maxX = fmin(x + settings.render_region_size, width);
@@ -281,6 +443,13 @@ void Renderer::resetPosition() {
             l = 1;
             break;
             
+        case PATTERN_HILBERT:
+        case PATTERN_MORTON:
+            // l is the side of the square grid of regions the curve fills, i the position along it
+            x = y = i = 0;
+            for (l = 1; l * settings.render_region_size < max(width, height); l *= 2);
+            break;
+            
         case PATTERN_HORIZONTAL:
         case PATTERN_VERTICAL:
         default:
@@ -295,6 +464,50 @@ void Renderer::resetPosition() {
     generateRange();
 }
 
+/// Regions to render in the order of render_pattern, regions preprocessing left out are skipped
+/// With cost_scheduling regions costing a large part of a thread's share are split into quarters and their pieces go first, so threads don't wait on a few slow regions at the end of a frame. The other regions keep the order of the pattern. A region's cost is estimated from the rays preRender traced for its center pixel
+vector<RenderRegion> Renderer::scheduleRegions(const vector<vector<RayInput>> &mask, const vector<vector<RayIntersection>> &buffer) {
+    vector<pair<RenderRegion, float>> regions; // Region and its estimated rays per pixel
+    do {
+        const int rx = x / settings.render_region_size, ry = y / settings.render_region_size;
+        if (mask[rx][ry].render) regions.push_back({RenderRegion(minX, maxX, minY, maxY), (float)max(buffer[rx][ry].rays, 1u)});
+    } while (next(mask));
+    
+    const auto cost = [](const pair<RenderRegion, float> &region) { return region.second * region.first.w * region.first.h; };
+    if (settings.cost_scheduling) {
+        float total = 0;
+        for (const auto &region : regions) total += cost(region);
+        const float limit = total / (max<short>(settings.rendering_threads, 1) * 8);
+        
+        // Regions over the limit are split and their pieces go first, everything else keeps the order of the pattern
+        vector<pair<RenderRegion, float>> pieces, rest;
+        const function<void(int, int, int, int, float)> split = [&](int minX, int maxX, int minY, int maxY, float rays) {
+            if (rays * (maxX - minX) * (maxY - minY) <= limit || maxX - minX < 4 || maxY - minY < 4) {
+                pieces.push_back({RenderRegion(minX, maxX, minY, maxY), rays});
+                return;
+            }
+            
+            const int midX = (minX + maxX) / 2, midY = (minY + maxY) / 2;
+            split(minX, midX, minY, midY, rays);
+            split(midX, maxX, minY, midY, rays);
+            split(minX, midX, midY, maxY, rays);
+            split(midX, maxX, midY, maxY, rays);
+        };
+        for (auto &region : regions) {
+            if (cost(region) > limit) split(region.first.x, region.first.x + region.first.w, region.first.y, region.first.y + region.first.h, region.second);
+            else rest.push_back(move(region));
+        }
+        
+        regions = move(pieces);
+        regions.insert(regions.end(), make_move_iterator(rest.begin()), make_move_iterator(rest.end()));
+    }
+    
+    vector<RenderRegion> scheduled;
+    scheduled.reserve(regions.size());
+    for (auto &region : regions) scheduled.push_back(move(region.first));
+    return scheduled;
+}
+
 bool Renderer::next(const vector<vector<RayInput>> &mask) {
     switch (settings.render_pattern) {
         case PATTERN_VERTICAL: // MARK: Vertical
@@ -329,6 +542,20 @@ bool Renderer::next(const vector<vector<RayInput>> &mask) {
             generateRange();
             return true;
             
+        case PATTERN_HILBERT: // MARK: Hilbert, Morton
+        case PATTERN_MORTON:
+            // Regions rendered one after another are close in the image, so their rays mostly hit the same objects and textures
+            do {
+                if (++i >= l * l) return false;
+                if (settings.render_pattern == PATTERN_HILBERT) hilbertRegion(l, i, x, y);
+                else mortonRegion(i, x, y);
+                x *= settings.render_region_size;
+                y *= settings.render_region_size;
+            } while (x >= width || y >= height || !mask[x/settings.render_region_size][y/settings.render_region_size].render);
+            
+            generateRange();
+            return true;
+            
         case PATTERN_HORIZONTAL: // MARK: Horizontal
         default:
             do {
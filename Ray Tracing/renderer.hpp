@@ -26,6 +26,7 @@ class Renderer;
 #include "objects.hpp"
 #include "light_sources.hpp"
 #include "camera.hpp"
+#include "animation.hpp"
 #include "interfaces.hpp"
 
 using namespace std;
@@ -34,6 +35,7 @@ struct RenderRegion {
     int x, y, w, h;
     Buffer buffer;
     Timer timer;
+    unsigned long shadow_tests = 0, shadow_hits = 0;
     
     RenderRegion() {
         x = y = w = h = 0;
@@ -54,31 +56,41 @@ private:
     Camera &camera;
     vector<Object *> &objects;
     vector<Light *> &lights;
+    Primitives primitives;
     
     int width, height, x, y;
     int region_count, region_current;
-    chrono::steady_clock::time_point start, end;
+    chrono::high_resolution_clock::time_point start, end;
     Timer timer;
     ObjectInfo info;
+    unsigned long shadow_tests, shadow_hits;
     
     int r, l, i;
     int minX, maxX, minY, maxY;
-    vector<Buffer> result;
+    Buffer result;
+    vector<vector<PrimaryHit>> gbuffer;
+    LightGrid light_grid;
     
     
     vector<vector<RayIntersection>> preRender();
     vector<vector<RayInput>> processPreRender(const vector<vector<RayIntersection>> &);
     
-    RenderRegion renderRegion(RenderRegion, const RayInput &, const RayIntersection &);
+    RenderRegion renderRegion(RenderRegion, RayInput, const RayIntersection &);
     
     void generateRange();
     void resetPosition();
     bool next(const vector<vector<RayInput>> &);
+    vector<RenderRegion> scheduleRegions(const vector<vector<RayInput>> &, const vector<vector<RayIntersection>> &);
+    
+    void stageFrame(int);
+    void commitFrame();
     
 public:
     Renderer(NativeInterface &, Camera &, vector<Object *> &, vector<Light *> &);
     
     void renderInfo();
+    void invalidate();
     void render();
-    Buffer getResult(short);
+    void renderSequence(const Animation &);
+    Buffer getResult();
 };
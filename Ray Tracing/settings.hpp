@@ -15,7 +15,11 @@ enum RenderType {
 };
 
 enum RenderPattern {
-    PATTERN_HORIZONTAL, PATTERN_VERTICAL, PATTERN_SPIRAL, RenderPatterns
+    PATTERN_HORIZONTAL, PATTERN_VERTICAL, PATTERN_SPIRAL, PATTERN_HILBERT, PATTERN_MORTON, RenderPatterns
+};
+
+enum BVHBuild {
+    BUILD_SAH, BUILD_MORTON, BVHBuilds
 };
 
 struct Settings {
@@ -26,6 +30,18 @@ struct Settings {
     
     short max_light_bounces = 5;
     
+    bool wavefront = false;
+    
+    float light_threshold = 0;
+    
+    short light_samples = 0;
+    
+    short bvh_build = BUILD_SAH;
+    
+    short bvh_width = 2;
+    
+    bool watertight_triangles = true;
+    
     // MARK: Camera
     short render_mode = RENDER_SHADED;
     
@@ -43,7 +59,12 @@ struct Settings {
     
     short rendering_threads = 25;
     
+    bool cost_scheduling = true;
+    
     Color background_color = Color::Black;
+    
+    // MARK: Textures
+    short texture_memory = 512;
 };
 
 extern Settings settings;
@@ -9,11 +9,183 @@
 #include "shaders.hpp"
 
 // MARK: - Textures
-///
-Image::Image(Buffer &image) : image(image) {}
+/// Texels are stored as 8-bit colors in 8x8 tiles, each tile in Morton order, so a bilinear lookup mostly stays within one tile
+Image::Level::Level(int width, int height) : width(width), height(height) {
+    tiles_x = (width + tile - 1) / tile;
+    count = tiles_x * ((height + tile - 1) / tile);
+    tiles.reset(new atomic<Tile *>[count]);
+    for (int i = 0; i < count; i++) tiles[i].store(nullptr);
+}
+
+Image::Level::~Level() {
+    if (tiles) for (int i = 0; i < count; i++) delete tiles[i].load();
+}
+
+inline int morton(int x, int y) {
+    return (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2 | (x & 4) << 2 | (y & 4) << 3;
+}
+
+inline Color decode(unsigned int texel) {
+    return Color((int)(texel >> 16 & 0xFF), (int)(texel >> 8 & 0xFF), (int)(texel & 0xFF));
+}
+
+/// @param loader function that decodes the image, called on first access and again after eviction
+Image::Image(function<bool(Bitmap &)> loader) : loader(loader), loaded(false), bytes(0), used(0) {}
+
+void Image::load() const {
+    lock_guard<mutex> lock(load_mutex);
+    if (loaded.load(memory_order_acquire)) return;
+    
+    Bitmap bitmap;
+    loader(bitmap);
+    if (bitmap.pixels.empty()) bitmap = {1, 1, {0}};
+    
+    // Level 0 is tiled right away, coarser levels are built tile by tile when first sampled
+    levels.clear();
+    levels.emplace_back(bitmap.width, bitmap.height);
+    for (int w = bitmap.width, h = bitmap.height; w > 1 || h > 1;) levels.emplace_back(w = max(w / 2, 1), h = max(h / 2, 1));
+    
+    Level &level = levels[0];
+    for (int i = 0; i < level.count; i++) {
+        Tile *data = new Tile();
+        const int x0 = (i % level.tiles_x) * tile, y0 = (i / level.tiles_x) * tile;
+        for (int x = 0; x < tile; x++) {
+            for (int y = 0; y < tile; y++) (*data)[morton(x, y)] = bitmap.pixels[min(y0 + y, level.height - 1) * level.width + min(x0 + x, level.width - 1)];
+        }
+        level.tiles[i].store(data, memory_order_relaxed);
+    }
+    bytes = level.count * sizeof(Tile);
+    
+    loaded.store(true, memory_order_release);
+}
+
+const Image::Tile &Image::getTile(int l, int tx, int ty) const {
+    Level &level = levels[l];
+    auto &slot = level.tiles[ty * level.tiles_x + tx];
+    
+    Tile *data = slot.load(memory_order_acquire);
+    if (data != nullptr) return *data;
+    
+    // Box filter the finer level, if another thread wins the race its tile is kept
+    data = new Tile();
+    for (int x = 0; x < tile; x++) {
+        for (int y = 0; y < tile; y++) {
+            const int px = min(tx * tile + x, level.width - 1) * 2, py = min(ty * tile + y, level.height - 1) * 2;
+            const Color average = (texel(l - 1, px, py) + texel(l - 1, px + 1, py) + texel(l - 1, px, py + 1) + texel(l - 1, px + 1, py + 1)) / 4.f;
+            (*data)[morton(x, y)] = (int)average;
+        }
+    }
+    
+    Tile *expected = nullptr;
+    if (slot.compare_exchange_strong(expected, data, memory_order_acq_rel)) bytes += sizeof(Tile);
+    else {
+        delete data;
+        data = expected;
+    }
+    return *data;
+}
+
+Color Image::texel(int l, int x, int y) const {
+    const Level &level = levels[l];
+    x = clamp(x, 0, level.width - 1);
+    y = clamp(y, 0, level.height - 1);
+    return decode(getTile(l, x / tile, y / tile)[morton(x % tile, y % tile)]);
+}
+
+Color Image::bilinear(int l, VectorUV t) const {
+    const float x = t.getU() * levels[l].width - 0.5f;
+    const float y = t.getV() * levels[l].height - 0.5f;
+    const int x0 = (int)floor(x), y0 = (int)floor(y);
+    const float dx = x - x0, dy = y - y0;
+    
+    return (texel(l, x0, y0) * (1 - dx) + texel(l, x0 + 1, y0) * dx) * (1 - dy) + (texel(l, x0, y0 + 1) * (1 - dx) + texel(l, x0 + 1, y0 + 1) * dx) * dy;
+}
+
+void Image::prefetch() const {
+    if (!loaded.load(memory_order_acquire)) load();
+}
+
+/// Must not be called while rendering
+void Image::evict() {
+    lock_guard<mutex> lock(load_mutex);
+    levels.clear();
+    bytes = 0;
+    loaded = false;
+}
+
+size_t Image::memory() const {
+    return bytes;
+}
+
+unsigned Image::lastUsed() const {
+    return used;
+}
 
 Color Image::operator()(VectorUV t) const {
-    return image[t.getU() * image.size()][t.getV() * image[0].size()];
+    return operator()(t, 0);
+}
+
+/// Trilinear lookup, the mip level is chosen so that one texel covers the footprint
+Color Image::operator()(VectorUV t, float footprint) const {
+    if (!loaded.load(memory_order_acquire)) load();
+    if (used.load(memory_order_relaxed) != TextureCache::frame) used.store(TextureCache::frame, memory_order_relaxed);
+    
+    const float lod = log2(max(footprint * max(levels[0].width, levels[0].height), 1.f));
+    const int level = min((int)lod, (int)levels.size() - 1);
+    if (level + 1 >= levels.size()) return bilinear(level, t);
+    
+    const float w = lod - level;
+    return bilinear(level, t) * (1 - w) + bilinear(level + 1, t) * w;
+}
+
+
+// MARK: - Texture cache
+mutex TextureCache::mutex_;
+map<string, shared_ptr<Image>> TextureCache::images;
+unsigned TextureCache::frame = 1;
+
+shared_ptr<Image> TextureCache::get(const string &path, function<bool(Bitmap &)> loader) {
+    lock_guard<mutex> lock(mutex_);
+    
+    auto &image = images[path];
+    if (image == nullptr) image = make_shared<Image>(loader);
+    
+    return image;
+}
+
+/// Evicts least recently used images until under budget, must not be called while rendering
+/// @param budget bytes of decoded texels to keep
+void TextureCache::trim(size_t budget) {
+    lock_guard<mutex> lock(mutex_);
+    
+    vector<shared_ptr<Image>> order;
+    size_t total = 0;
+    for (auto it = images.begin(); it != images.end();) {
+        // Nothing references the image since the scene was reloaded
+        if (it->second.use_count() == 1) it = images.erase(it);
+        else {
+            total += it->second->memory();
+            order.push_back((it++)->second);
+        }
+    }
+    
+    sort(order.begin(), order.end(), [](const shared_ptr<Image> &a, const shared_ptr<Image> &b) { return a->lastUsed() < b->lastUsed(); });
+    for (auto &image : order) {
+        if (total <= budget) break;
+        total -= image->memory();
+        image->evict();
+    }
+    
+    frame++;
+}
+
+size_t TextureCache::usage() {
+    lock_guard<mutex> lock(mutex_);
+    
+    size_t total = 0;
+    for (const auto &[path, image] : images) total += image->memory();
+    
+    return total;
 }
 
 
@@ -29,15 +201,13 @@ Color Checkerboard::operator()(VectorUV t) const {
 Bricks::Bricks(int scale, float ratio, float mortar, Color primary, Color secondary, Color tertiary, int seed) : scale(scale), ratio(ratio), mortar(mortar), primary(primary), secondary(secondary), tertiary(tertiary) {
     colors.resize(scale, vector<Color>(ceil(scale / ratio) + 1));
     
-    default_random_engine engine(seed);
-
-    uniform_real_distribution<float> dist(0, 1);
-    for (auto &i : colors) {
-        for (auto &j : i) {
-            auto a = dist(engine);
-            j = primary * a + secondary * (1.f - a);
-         }
-     }
+    // Every brick gets its own random number, so they don't change with the platform's standard library
+    for (int i = 0; i < colors.size(); i++) {
+        for (int j = 0; j < colors[i].size(); j++) {
+            auto a = Random(i, j, seed).uniform();
+            colors[i][j] = primary * a + secondary * (1.f - a);
+        }
+    }
 }
 
 Color Bricks::operator()(VectorUV t) const {
@@ -53,14 +223,11 @@ Color Bricks::operator()(VectorUV t) const {
 PerlinNoise::PerlinNoise(int scale, int seed, Color primary) : scale(scale), primary(primary) {
     points.resize(scale, vector<pair<float, float>>(scale));
     
-    default_random_engine engine(seed);
-    
-    uniform_real_distribution<float> dist(0, M_PI * 2);
-    for (auto &i : points) {
-        for (auto &j : i) {
-            auto a = dist(engine);
-            j.first = cos(a);
-            j.second = sin(a);
+    for (int i = 0; i < scale; i++) {
+        for (int j = 0; j < scale; j++) {
+            auto a = Random(i, j, seed).uniform() * M_PI * 2;
+            points[i][j].first = cos(a);
+            points[i][j].second = sin(a);
         }
     }
 }
@@ -93,3 +260,159 @@ Color PerlinNoise::operator()(VectorUV t) const {
     
     return primary * (lerp(ix0, ix1, dy) / 2 + 0.5);
 }
+
+
+// MARK: - Shader
+atomic<unsigned> Shader::ids(0);
+
+void Shader::emit(Opcode opcode, int operand) {
+    code.push_back({opcode, operand, 0});
+    id = ++ids;
+    max_depth = max(max_depth, ++depth);
+}
+
+void Shader::push(Color color) {
+    constants.push_back(color);
+    emit(OP_CONSTANT, (int)constants.size() - 1);
+}
+
+void Shader::push(shared_ptr<Image> image) {
+    images.push_back(image);
+    emit(OP_IMAGE, (int)images.size() - 1);
+}
+
+void Shader::push(Checkerboard checkerboard) {
+    checkerboards.push_back(checkerboard);
+    emit(OP_CHECKERBOARD, (int)checkerboards.size() - 1);
+}
+
+void Shader::push(Bricks brick) {
+    bricks.push_back(brick);
+    emit(OP_BRICKS, (int)bricks.size() - 1);
+}
+
+void Shader::push(PerlinNoise noise) {
+    noises.push_back(noise);
+    emit(OP_NOISE, (int)noises.size() - 1);
+}
+
+/// Inlines another shader, its leaves are appended and operands rebased
+void Shader::push(const Shader &shader) {
+    if (shader.code.empty()) return push(Color::Black);
+    
+    max_depth = max(max_depth, depth + shader.max_depth);
+    id = ++ids;
+    for (auto instruction : shader.code) {
+        switch (instruction.opcode) {
+            case OP_CONSTANT: instruction.operand += constants.size(); break;
+            case OP_IMAGE: instruction.operand += images.size(); break;
+            case OP_CHECKERBOARD: instruction.operand += checkerboards.size(); break;
+            case OP_BRICKS: instruction.operand += bricks.size(); break;
+            case OP_NOISE: instruction.operand += noises.size(); break;
+            default: break;
+        }
+        code.push_back(instruction);
+    }
+    depth++;
+    
+    constants.insert(constants.end(), shader.constants.begin(), shader.constants.end());
+    images.insert(images.end(), shader.images.begin(), shader.images.end());
+    checkerboards.insert(checkerboards.end(), shader.checkerboards.begin(), shader.checkerboards.end());
+    bricks.insert(bricks.end(), shader.bricks.begin(), shader.bricks.end());
+    noises.insert(noises.end(), shader.noises.begin(), shader.noises.end());
+}
+
+/// Appends an operation, folding it right away when its operands are constants
+/// @param opcode one of the unary (grayscale, negate, scale) or binary (add, multiply) operations
+/// @param weight factor for scale
+void Shader::apply(Opcode opcode, float weight) {
+    const int arity = opcode == OP_ADD || opcode == OP_MULTIPLY ? 2 : 1;
+    id = ++ids;
+    
+    const auto n = code.size();
+    if (n >= arity && all_of(code.end() - arity, code.end(), [](const Instruction &i) { return i.opcode == OP_CONSTANT; })) {
+        const Color a = constants[code[n - arity].operand], b = constants[code[n - 1].operand];
+        Color &result = constants[code[n - arity].operand];
+        switch (opcode) {
+            case OP_GRAYSCALE: result = Color::White * a.asValue(); break;
+            case OP_NEGATE: result = -a; break;
+            case OP_SCALE: result = a * weight; break;
+            case OP_ADD: result = a + b; break;
+            case OP_MULTIPLY: result = a * b; break;
+            default: break;
+        }
+        if (arity == 2) {
+            constants.pop_back();
+            code.pop_back();
+            depth--;
+        }
+        return;
+    }
+    
+    code.push_back({opcode, 0, weight});
+    depth -= arity - 1;
+}
+
+bool Shader::isConstant() const {
+    return code.size() == 1 && code[0].opcode == OP_CONSTANT;
+}
+
+/// Shared by every copy of a shader, a new one is taken whenever the tape changes so copies of the same parsed shader (e.g. a named one) can be evaluated as one batch
+unsigned Shader::identity() const {
+    return id;
+}
+
+/// Decodes all images now instead of on first use
+void Shader::prefetch() const {
+    for (const auto &image : images) image->prefetch();
+}
+
+/// Bytes of the tape and its operands, image texels are counted by TextureCache
+size_t Shader::memory() const {
+    return code.capacity() * sizeof(Instruction) + constants.capacity() * sizeof(Color) + images.capacity() * sizeof(shared_ptr<Image>) + checkerboards.capacity() * sizeof(Checkerboard) + bricks.capacity() * sizeof(Bricks) + noises.capacity() * sizeof(PerlinNoise);
+}
+
+/// @param t texture coordinates
+/// @param footprint ray footprint in texture space
+Color Shader::operator()(VectorUV t, float footprint) const {
+    if (code.empty()) return Color::Black;
+    if (isConstant()) return constants[code[0].operand];
+    
+    Color result;
+    operator()(&t, &footprint, &result, 1);
+    return result;
+}
+
+/// Evaluates the tape one instruction at a time over a whole batch
+/// @param t texture coordinates
+/// @param footprint ray footprints in texture space, may be null
+/// @param result output colors
+/// @param count batch size
+void Shader::operator()(const VectorUV *t, const float *footprint, Color *result, int count) const {
+    if (code.empty()) return fill(result, result + count, Color::Black);
+    
+    // Registers are laid out by stack slot, then by lane
+    static thread_local vector<Color> registers;
+    if (registers.size() < max_depth * count) registers.resize(max_depth * count);
+    
+    // The slot is kept as an index, a pointer one slot below the registers would already be out of bounds
+    int slot = -1;
+    Color *top = registers.data();
+    for (const auto &instruction : code) {
+        switch (instruction.opcode) {
+            case OP_CONSTANT: top = registers.data() + ++slot * count; fill(top, top + count, constants[instruction.operand]); break;
+            case OP_IMAGE: top = registers.data() + ++slot * count; for (int i = 0; i < count; i++) top[i] = (*images[instruction.operand])(t[i], footprint ? footprint[i] : 0); break;
+            case OP_CHECKERBOARD: top = registers.data() + ++slot * count; for (int i = 0; i < count; i++) top[i] = checkerboards[instruction.operand](t[i]); break;
+            case OP_BRICKS: top = registers.data() + ++slot * count; for (int i = 0; i < count; i++) top[i] = bricks[instruction.operand](t[i]); break;
+            case OP_NOISE: top = registers.data() + ++slot * count; for (int i = 0; i < count; i++) top[i] = noises[instruction.operand](t[i]); break;
+                
+            case OP_GRAYSCALE: for (int i = 0; i < count; i++) top[i] = Color::White * top[i].asValue(); break;
+            case OP_NEGATE: for (int i = 0; i < count; i++) top[i] = -top[i]; break;
+            case OP_SCALE: for (int i = 0; i < count; i++) top[i] = top[i] * instruction.weight; break;
+            case OP_ADD: top = registers.data() + --slot * count; for (int i = 0; i < count; i++) top[i] += top[i + count]; break;
+            case OP_MULTIPLY: top = registers.data() + --slot * count; for (int i = 0; i < count; i++) top[i] *= top[i + count]; break;
+        }
+    }
+    
+    copy(top, top + count, result);
+}
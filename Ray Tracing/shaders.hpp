@@ -7,8 +7,10 @@
 //
 
 struct Material;
+class Shader;
 
 class Image;
+class TextureCache;
 class Checkerboard;
 class Bricks;
 class PerlinNoise;
@@ -17,24 +19,17 @@ class PerlinNoise;
 
 #include <iostream>
 #include <array>
-#include <random>
 #include <algorithm>
 #include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <map>
 
 #include "data_types.hpp"
 
 using namespace std;
 
-typedef function<Color(VectorUV)> Shader;
-
-// MARK: - Material
-struct Material {
-    Shader texture;
-    float n, Ks, ior;
-    bool transparent;
-};
-
-
 // MARK: - Textures
 class Texture {
 public:
@@ -44,12 +39,55 @@ public:
 
 class Image : public Texture {
 private:
-    Buffer image;
+    static const int tile = 8;
+    typedef array<unsigned int, tile * tile> Tile;
+    
+    struct Level {
+        int width, height, tiles_x, count;
+        unique_ptr<atomic<Tile *>[]> tiles;
+        
+        Level(int, int);
+        Level(Level &&) = default;
+        ~Level();
+    };
+    
+    function<bool(Bitmap &)> loader;
+    mutable vector<Level> levels;
+    mutable mutex load_mutex;
+    mutable atomic<bool> loaded;
+    mutable atomic<size_t> bytes;
+    mutable atomic<unsigned> used;
+    
+    void load() const;
+    const Tile &getTile(int, int, int) const;
+    inline Color texel(int, int, int) const;
+    Color bilinear(int, VectorUV) const;
     
 public:
-    explicit Image(Buffer &);
+    explicit Image(function<bool(Bitmap &)>);
+    
+    void prefetch() const;
+    void evict();
+    size_t memory() const;
+    unsigned lastUsed() const;
     
     Color operator()(VectorUV) const;
+    Color operator()(VectorUV, float) const;
+};
+
+
+// Process-wide, images are shared by path and evicted least recently used first
+class TextureCache {
+private:
+    static mutex mutex_;
+    static map<string, shared_ptr<Image>> images;
+    
+public:
+    static unsigned frame;
+    
+    static shared_ptr<Image> get(const string &, function<bool(Bitmap &)>);
+    static void trim(size_t);
+    static size_t usage();
 };
 
 
@@ -94,3 +132,59 @@ public:
     
     Color operator()(VectorUV) const;
 };
+
+
+// MARK: - Shader
+enum Opcode : unsigned char {
+    OP_CONSTANT, OP_IMAGE, OP_CHECKERBOARD, OP_BRICKS, OP_NOISE,
+    OP_GRAYSCALE, OP_NEGATE, OP_SCALE, OP_ADD, OP_MULTIPLY
+};
+
+// Shader graph flattened into a stack machine tape, leaves push a color, operations replace the top one or two
+class Shader {
+private:
+    struct Instruction {
+        Opcode opcode;
+        int operand;
+        float weight;
+    };
+    
+    vector<Instruction> code;
+    vector<Color> constants;
+    vector<shared_ptr<Image>> images;
+    vector<Checkerboard> checkerboards;
+    vector<Bricks> bricks;
+    vector<PerlinNoise> noises;
+    int depth = 0, max_depth = 0;
+    unsigned id = 0;
+    
+    static atomic<unsigned> ids;
+    
+    void emit(Opcode, int);
+    
+public:
+    void push(Color);
+    void push(shared_ptr<Image>);
+    void push(Checkerboard);
+    void push(Bricks);
+    void push(PerlinNoise);
+    void push(const Shader &);
+    void apply(Opcode, float = 0);
+    
+    bool isConstant() const;
+    unsigned identity() const;
+    void prefetch() const;
+    size_t memory() const;
+    
+    // Texture coordinates and the ray footprint in texture space (0 for a single point)
+    Color operator()(VectorUV, float) const;
+    void operator()(const VectorUV *, const float *, Color *, int) const;
+};
+
+
+// MARK: - Material
+struct Material {
+    Shader texture;
+    float n, Ks, ior;
+    bool transparent, cull_backfaces;
+};
@@ -0,0 +1,228 @@
+//
+//  golden.cpp
+//  Ray Tracing
+//
+//  Created by Adam Svestka on 10/19/26.
+//  Copyright © 2026 Adam Svestka. All rights reserved.
+//
+
+// Renders a scene in every render mode and compares each layer against its reference image and against what the interface shows
+// Built with HeadlessInterface, or with X11Interface to run under a virtual framebuffer
+// Usage: golden [--update] [--tolerance mean] [--outliers fraction] settings.ini scene.json references/ output/
+
+#include <iostream>
+#include <vector>
+#include <array>
+#include <cmath>
+#include <iomanip>
+
+#include "settings.hpp"
+#include "data_types.hpp"
+#include "file_managers.hpp"
+#include "objects.hpp"
+#include "light_sources.hpp"
+#include "camera.hpp"
+#include "animation.hpp"
+#include "renderer.hpp"
+#include "interfaces.hpp"
+
+using namespace std;
+
+Settings settings;
+
+// File names of the render modes, in the order of RenderType
+static const array<string, RenderTypes> layer_names = {"shaded", "textures", "reflections", "transmission", "light", "shadows", "normals", "inverse_normals", "depth", "objects"};
+
+// MARK: - Comparison
+struct Difference {
+    float mean = 0, rmse = 0, outliers = 0; // Mean perceptual error, root mean square error in 8 bit steps and the fraction of pixels with a visible error
+    Buffer heatmap;
+};
+
+/// CIELAB of an sRGB pixel
+array<float, 3> lab(unsigned int pixel) {
+    float rgb[3];
+    for (int c = 0; c < 3; c++) {
+        const float v = (pixel >> (16 - 8 * c) & 0xff) / 255.f;
+        rgb[c] = v <= 0.04045f ? v / 12.92f : pow((v + 0.055f) / 1.055f, 2.4f);
+    }
+    
+    const float xyz[3] = {
+        (0.4124f * rgb[0] + 0.3576f * rgb[1] + 0.1805f * rgb[2]) / 0.9505f,
+        0.2126f * rgb[0] + 0.7152f * rgb[1] + 0.0722f * rgb[2],
+        (0.0193f * rgb[0] + 0.1192f * rgb[1] + 0.9505f * rgb[2]) / 1.089f
+    };
+    float f[3];
+    for (int c = 0; c < 3; c++) f[c] = xyz[c] > 0.008856f ? cbrt(xyz[c]) : 7.787f * xyz[c] + 16 / 116.f;
+    
+    return {116 * f[1] - 16, 500 * (f[0] - f[1]), 200 * (f[1] - f[2])};
+}
+
+/// Black through red and yellow to white
+Color heat(float error) {
+    static const array<Color, 5> stops = {Color(0.f, 0.f, 0.f), Color(0.35f, 0.f, 0.5f), Color(0.9f, 0.2f, 0.1f), Color(1.f, 0.85f, 0.f), Color(1.f, 1.f, 1.f)};
+    const float position = min(max(error, 0.f), 1.f) * (stops.size() - 1);
+    const int i = min((int)position, (int)stops.size() - 2);
+    const float t = position - i;
+    return stops[i] * (1 - t) + stops[i + 1] * t;
+}
+
+/// Error in the spirit of FLIP: color differences are measured in CIELAB after a small blur, which hides changes too fine to see, and are amplified where edges moved
+/// @param result rendered image
+/// @param reference image to compare against, same size
+Difference compare(const Buffer &result, const Bitmap &reference) {
+    const int width = reference.width, height = reference.height;
+    vector<array<float, 3>> images[2] = {vector<array<float, 3>>(width * height), vector<array<float, 3>>(width * height)};
+    Difference difference;
+    
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            const unsigned int pixel = (int)result[x][y][0] << 16 | (int)result[x][y][1] << 8 | (int)result[x][y][2];
+            images[0][y * width + x] = lab(pixel);
+            images[1][y * width + x] = lab(reference.pixels[y * width + x]);
+            
+            for (int c = 0; c < 3; c++) {
+                const float delta = (float)(pixel >> (16 - 8 * c) & 0xff) - (reference.pixels[y * width + x] >> (16 - 8 * c) & 0xff);
+                difference.rmse += delta * delta;
+            }
+        }
+    }
+    difference.rmse = sqrt(difference.rmse / (width * height * 3));
+    
+    // 3x3 binomial filters, clamped at the borders
+    const auto at = [&](const vector<array<float, 3>> &image, int x, int y) -> const array<float, 3> & {
+        return image[min(max(y, 0), height - 1) * width + min(max(x, 0), width - 1)];
+    };
+    const float weights[3] = {1, 2, 1};
+    
+    difference.heatmap = Buffer(width, vector<Color>(height));
+    for (int x = 0; x < width; x++) {
+        for (int y = 0; y < height; y++) {
+            array<float, 3> blurred[2] = {};
+            float gradient[2][2] = {};
+            for (int i = 0; i < 2; i++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    for (int dy = -1; dy <= 1; dy++) {
+                        const auto &value = at(images[i], x + dx, y + dy);
+                        for (int c = 0; c < 3; c++) blurred[i][c] += value[c] * weights[dx + 1] * weights[dy + 1] / 16;
+                        gradient[i][0] += value[0] * dx * weights[dy + 1] / 4;
+                        gradient[i][1] += value[0] * dy * weights[dx + 1] / 4;
+                    }
+                }
+            }
+            
+            // HyAB distance, scaled so that 1 is a difference between black and white
+            const float color = min((abs(blurred[0][0] - blurred[1][0]) + hypot(blurred[0][1] - blurred[1][1], blurred[0][2] - blurred[1][2])) / 100, 1.f);
+            const float feature = min(hypot(gradient[0][0] - gradient[1][0], gradient[0][1] - gradient[1][1]) / 100, 1.f);
+            const float error = pow(color, 1 - feature);
+            
+            difference.mean += error;
+            if (error > 0.05f) difference.outliers++;
+            difference.heatmap[x][y] = heat(error);
+        }
+    }
+    difference.mean /= width * height;
+    difference.outliers /= width * height;
+    
+    return difference;
+}
+
+/// Pixels of the render that differ from what the interface shows, the render info box in the top left corner is skipped
+int unpresented(const Buffer &result, const Buffer &frame) {
+    const int size = settings.resolution_decrease;
+    int count = 0;
+    for (int x = 0; x < result.size(); x++) {
+        for (int y = 0; y < result[x].size(); y++) {
+            if (x * size < 3 + 6 * 28 && y * size < 6 + 15 * 7) continue;
+            const Color &shown = frame[x * size][y * size];
+            if (shown[0] != result[x][y][0] || shown[1] != result[x][y][1] || shown[2] != result[x][y][2]) count++;
+        }
+    }
+    
+    return count;
+}
+
+
+// MARK: - Main
+int main(int argc, const char *argv[]) {
+    bool update = false;
+    float tolerance = 0.002, outliers = 0.002;
+    vector<string> paths;
+    for (int i = 1; i < argc; i++) {
+        const string argument = argv[i];
+        if (argument == "--update") update = true;
+        else if (argument == "--tolerance" && i + 1 < argc) tolerance = stof(argv[++i]);
+        else if (argument == "--outliers" && i + 1 < argc) outliers = stof(argv[++i]);
+        else paths.push_back(argument);
+    }
+    if (paths.size() != 4) {
+        cerr << "Usage: " << argv[0] << " [--update] [--tolerance mean] [--outliers fraction] settings.ini scene.json references/ output/" << endl;
+        return 2;
+    }
+    const string scene_path = paths[1], references = paths[2] + "/", output = paths[3] + "/";
+    const string name = scene_path.substr(scene_path.find_last_of('/') + 1, scene_path.find_last_of('.') - scene_path.find_last_of('/') - 1);
+    
+    NativeInterface interface(argc, argv);
+    
+    Camera camera;
+    vector<Object *> objects;
+    vector<Light *> lights;
+    Animation animation;
+    
+    Parser parser(interface);
+    parser.parseSettings(paths[0], settings);
+    parser.parseScene(scene_path, camera, objects, lights, animation);
+    
+    // Layers after the first are shaded again from the G-buffer, like switching modes in the viewer
+    Renderer renderer(interface, camera, objects, lights);
+    int failures = 0;
+    stringstream report;
+    report << fixed << setprecision(4);
+    for (short mode = 0; mode < RenderTypes; mode++) {
+        settings.render_mode = mode;
+        renderer.render();
+        const Buffer result = renderer.getResult();
+        const string filename = name + "_" + layer_names[mode] + ".png";
+        
+        if (update) {
+            if (!interface.saveImage(references + filename, result)) {
+                interface.log("Unable to save " + references + filename);
+                failures++;
+            }
+            continue;
+        }
+        
+        if (const int missing = unpresented(result, interface.getFrame())) {
+            report << layer_names[mode] << ": " << missing << " pixels of the render are not shown by the interface" << endl;
+            failures++;
+        }
+        
+        Bitmap reference;
+        if (!interface.loadImage(references + filename, reference)) {
+            report << layer_names[mode] << ": no reference " << references + filename << ", run with --update to create it" << endl;
+            failures++;
+            continue;
+        }
+        if (reference.width != result.size() || reference.height != result[0].size()) {
+            report << layer_names[mode] << ": size " << result.size() << "x" << result[0].size() << " differs from the reference " << reference.width << "x" << reference.height << endl;
+            failures++;
+            continue;
+        }
+        
+        const auto difference = compare(result, reference);
+        const bool passed = difference.mean <= tolerance && difference.outliers <= outliers;
+        report << layer_names[mode] << ": mean " << difference.mean << ", rmse " << difference.rmse << ", outliers " << 100 * difference.outliers << "%";
+        if (!passed) {
+            interface.saveImage(output + filename, result);
+            interface.saveImage(output + name + "_" + layer_names[mode] + "_diff.png", difference.heatmap);
+            report << " FAILED, see " << output + name + "_" + layer_names[mode] + "_diff.png";
+            failures++;
+        }
+        report << endl;
+    }
+    
+    cout << report.str();
+    if (update) cout << "Updated " << RenderTypes - failures << " references of " << name << endl;
+    
+    return failures > 0;
+}